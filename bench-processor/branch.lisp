@@ -0,0 +1,12 @@
+; Taken and not taken branches mixed with no pattern a predictor would like
+(set i 0)
+(set x 7)
+(set hits 0)
+(while (< i 5000)
+       (progn
+         (set x (% (+ (* x 75) 74) 65537))
+         (if (% x 3)
+           (if (% x 5) (set hits (+ hits 1)) 0)
+           (set hits (- hits 1)))
+         (set i (+ i 1))))
+(write-mem 3 (+ 48 (% (+ hits 100000) 10)))
@@ -0,0 +1,13 @@
+; Straight-line arithmetic in nested counted loops
+(set i 0)
+(set acc 0)
+(while (< i 200)
+       (progn
+         (set j 0)
+         (while (< j 50)
+                (progn
+                  (set acc (+ (* acc 3) j))
+                  (set acc (% acc 1000))
+                  (set j (+ j 1))))
+         (set i (+ i 1))))
+(write-mem 3 (+ 48 (% acc 10)))
@@ -0,0 +1,204 @@
+#include "manifest.hpp"
+#include "mmio.hpp"
+#include "processor.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ===========================================================================
+// How many ticks a host second simulates, on a fixed corpus of programs,
+// with the trace on and off.
+//
+// The manifest (see manifest.hpp) has a program per line:
+//
+//   <name> <image> <stdin file>
+//
+// A "-" for stdin means empty input.
+//
+// Every program is measured a number of times. A single measurement runs it
+// over and over until enough time has passed for the clock to be any good,
+// since some of the programs are done in a few microseconds, and the others
+// are cut short at `--max-ticks`, since traced they would take minutes. The
+// trace goes to stderr, as with `processor`, and is best thrown away.
+//
+// Results are written as a line per program and trace setting, in the order
+// of the manifest, to be diffed against those of another build. Given such a
+// file as the baseline, how the medians moved is printed as well.
+
+namespace {
+
+struct Program {
+  std::string name;
+  std::vector<u32> image;
+  std::string input;
+};
+
+struct Result {
+  std::string name;
+  bool traced;
+  u64 ticks; // Of a single run, so it is clear when a program ran differently
+  std::vector<double> ticks_per_second; // A measurement each
+};
+
+std::vector<Program> read_manifest(const char* filename) {
+  const Manifest manifest(filename);
+  std::vector<Program> programs;
+
+  for (const Manifest::Entry& entry: manifest.entries) {
+    if (entry.fields.size() != 3)
+      FATAL("{}:{}: Expected '<name> <image> <stdin>'", filename, entry.line_number);
+    Program& program = programs.emplace_back();
+    program.name = entry.fields[0];
+    program.image = read_image(manifest.path(entry.fields[1]));
+    if (entry.fields[2] != "-")
+      program.input = read_whole_file(manifest.path(entry.fields[2]));
+  }
+  return programs;
+}
+
+template<bool traced>
+u64 run_once(const Program& program, u32 max_ticks) {
+  Buffer_mmio io(program.input);
+  Processor proc(program.image, io);
+  while (proc.stats.ticked < max_ticks && proc.next_tick<traced>(max_ticks - proc.stats.ticked)) { }
+  return proc.stats.ticked;
+}
+
+template<bool traced>
+Result measure(const Program& program, u32 num_runs, u32 max_ticks, std::chrono::nanoseconds min_time) {
+  using Clock = std::chrono::steady_clock;
+  Result result = { program.name, traced, run_once<traced>(program, max_ticks), {} };
+
+  for (u32 i = 0; i < num_runs; i++) {
+    u64 ticks = 0;
+    const auto start = Clock::now();
+    auto elapsed = Clock::duration::zero();
+    do {
+      ticks += run_once<traced>(program, max_ticks);
+      elapsed = Clock::now() - start;
+    } while (elapsed < min_time);
+    result.ticks_per_second.push_back(double(ticks) / std::chrono::duration<double>(elapsed).count());
+  }
+  return result;
+}
+
+struct Summary {
+  double median;
+  double mean;
+  double stddev;
+};
+
+Summary summarize(std::vector<double> xs) {
+  std::sort(xs.begin(), xs.end());
+  const size_t n = xs.size();
+  const double median = (n % 2) ? xs[n / 2] : (xs[n / 2 - 1] + xs[n / 2]) / 2;
+  double sum = 0, sum_squares = 0;
+  for (double x: xs) {
+    sum += x;
+    sum_squares += x * x;
+  }
+  const double mean = sum / double(n);
+  const double variance = n > 1 ? std::max(0.0, (sum_squares - sum * mean) / double(n - 1)) : 0.0;
+  return Summary { median, mean, std::sqrt(variance) };
+}
+
+const char* trace_name(bool traced) { return traced ? "on" : "off"; }
+
+// Medians of a results file, by program and trace setting
+std::map<std::pair<std::string, std::string>, double> read_baseline(const char* filename) {
+  std::istringstream in(read_whole_file(filename));
+  std::map<std::pair<std::string, std::string>, double> medians;
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); line_number++) {
+    std::istringstream fields(line);
+    std::string name, trace;
+    u64 ticks, runs;
+    double median;
+    if (!(fields >> name) || name.starts_with('#'))
+      continue;
+    if (!(fields >> trace >> ticks >> runs >> median))
+      FATAL("{}:{}: Not a line of results", filename, line_number);
+    medians[{ name, trace }] = median;
+  }
+  return medians;
+}
+
+void usage(const char* argv0) {
+  FATAL("Usage: {} [--runs=N] [--min-time=MS] [--max-ticks=N] [--results=FILE] [--baseline=FILE] <manifest>", argv0);
+}
+
+} // anon namespace
+
+int main(int argc, char** argv) {
+  const char* manifest_filename = nullptr;
+  const char* results_filename = nullptr;
+  const char* baseline_filename = nullptr;
+  u32 num_runs = 11;
+  u32 min_time_ms = 50;
+  u32 max_ticks = 200'000;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    std::string_view value = arg.substr(arg.find('=') + 1);
+    if (arg.starts_with("--runs="))
+      num_runs = std::max(1u, util::parse_number(value));
+    else if (arg.starts_with("--min-time="))
+      min_time_ms = util::parse_number(value);
+    else if (arg.starts_with("--max-ticks="))
+      max_ticks = std::max(1u, util::parse_number(value));
+    else if (arg.starts_with("--results="))
+      results_filename = argv[i] + arg.find('=') + 1;
+    else if (arg.starts_with("--baseline="))
+      baseline_filename = argv[i] + arg.find('=') + 1;
+    else if (!arg.starts_with("--") && !manifest_filename)
+      manifest_filename = argv[i];
+    else
+      usage(argv[0]);
+  }
+  if (!manifest_filename)
+    usage(argv[0]);
+
+  const std::vector<Program> programs = read_manifest(manifest_filename);
+  const auto baseline = baseline_filename
+    ? read_baseline(baseline_filename)
+    : std::map<std::pair<std::string, std::string>, double>{};
+  const std::chrono::milliseconds min_time(min_time_ms);
+
+  std::vector<Result> results;
+  for (const Program& program: programs) {
+    results.push_back(measure<false>(program, num_runs, max_ticks, min_time));
+    results.push_back(measure<true>(program, num_runs, max_ticks, min_time));
+  }
+
+  // Only printed once all is done, so that it is not lost among the trace
+  for (const Result& result: results) {
+    const Summary s = summarize(result.ticks_per_second);
+    fmt::print(FMT_STRING("{:12} trace {:3}: {:10.0f} ticks/s median, +- {:5.2f}%"),
+        result.name, trace_name(result.traced), s.median, 100 * s.stddev / s.mean);
+    const auto old = baseline.find({ result.name, trace_name(result.traced) });
+    if (old != baseline.end())
+      fmt::print(FMT_STRING(", {:+.2f}% from baseline"), 100 * (s.median / old->second - 1));
+    fmt::print(FMT_STRING("\n"));
+  }
+
+  if (results_filename) {
+    std::FILE* out = std::fopen(results_filename, "w");
+    if (!out)
+      FATAL("Failed to open '{}' for writing", results_filename);
+    fmt::print(out, FMT_STRING("# program trace ticks runs median mean stddev (in ticks per second)\n"));
+    for (const Result& result: results) {
+      const Summary s = summarize(result.ticks_per_second);
+      fmt::print(out, FMT_STRING("{} {} {} {} {:.0f} {:.0f} {:.0f}\n"),
+          result.name, trace_name(result.traced), result.ticks,
+          result.ticks_per_second.size(), s.median, s.mean, s.stddev);
+    }
+    std::fclose(out);
+  }
+}
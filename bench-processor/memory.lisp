@@ -0,0 +1,17 @@
+; Fills a buffer and keeps summing it up, mostly loads and stores
+(set buf (alloc-static 256))
+(set i 0)
+(while (< i 256)
+       (progn
+         (write-mem (+ buf i) i)
+         (set i (+ i 1))))
+(set pass 0)
+(while (< pass 40)
+       (progn
+         (set i 0)
+         (while (< i 255)
+                (progn
+                  (write-mem (+ buf i) (+ (read-mem (+ buf i)) (read-mem (+ buf (+ i 1)))))
+                  (set i (+ i 1))))
+         (set pass (+ pass 1))))
+(write-mem 3 (+ 48 (% (read-mem buf) 10)))
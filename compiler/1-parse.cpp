@@ -15,8 +15,9 @@ namespace {
 
 struct Lexer {
   std::istream& is;
+  Ast::Source_pos pos = { .line = 1, .column = 1 }; // Of the next character
 
-  struct Opening_paren {};
+  struct Opening_paren { Ast::Source_pos pos; };
   struct Closing_paren {};
   struct Identifier { std::string name; };
   struct Number { int32_t value; };
@@ -51,6 +52,12 @@ struct Lexer {
     [[maybe_unused]] int c = is.get();
     assert(c != -1);
     assert(c == expected);
+    if (expected == '\n') {
+      pos.line++;
+      pos.column = 1;
+    } else {
+      pos.column++;
+    }
   }
 
   std::optional<char> peek_after_whitespace() {
@@ -118,9 +125,11 @@ struct Lexer {
     if (!peeked)
       return std::nullopt;
     switch (*peeked) {
-    case '(':
+    case '(': {
+      const Ast::Source_pos at = pos;
       consume_expect(*peeked);
-      return Opening_paren{};
+      return Opening_paren{ at };
+    }
     case ')':
       consume_expect(*peeked);
       return Closing_paren{};
@@ -142,7 +151,9 @@ Ast Ast::parse_stream(std::istream& is) {
     if (stack.empty()) {
       // Root context is special: only parens can appear here
       token->match(
-        [&] (Lexer::Opening_paren) { stack.push_back(&tree.sexprs.emplace_back()); },
+        [&] (Lexer::Opening_paren paren) {
+          stack.push_back(&tree.sexprs.emplace_back(Parens{ .children = {}, .pos = paren.pos }));
+        },
         [&] (Lexer::Closing_paren) { error("Unbalanced parens: too many closing"); },
         [&] (auto&&) { error("At root scope, only opening parens is allowed"); }
       );
@@ -152,8 +163,8 @@ Ast Ast::parse_stream(std::istream& is) {
     // General case
     auto& context = stack.back()->children;
     token->match(
-      [&] (Lexer::Opening_paren) {
-        auto new_top = &context.emplace_back(Parens{}).as<Parens>();
+      [&] (Lexer::Opening_paren paren) {
+        auto new_top = &context.emplace_back(Parens{ .children = {}, .pos = paren.pos }).as<Parens>();
         stack.push_back(new_top);
       },
       [&] (Lexer::Closing_paren) {
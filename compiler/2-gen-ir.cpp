@@ -11,6 +11,18 @@
 namespace {
 
 constexpr uint32_t mmio_addr = 0x3;
+constexpr uint32_t num_cores_addr = 0x1;
+constexpr uint32_t core_id_addr = 0x2;
+constexpr uint32_t dma_src_addr = 0x4;
+constexpr uint32_t dma_dst_addr = 0x5;
+constexpr uint32_t dma_len_addr = 0x6;
+constexpr uint32_t mmio_packed_addr = 0x7;
+constexpr uint32_t ticked_addr = 0x8;
+constexpr uint32_t stalled_addr = 0x9;
+constexpr uint32_t retired_addr = 0xA;
+constexpr uint32_t marker_addr = 0xB;
+constexpr uint32_t num_reserved_words = 0xC;
+constexpr uint32_t vector_width = 4;
 
 struct Compiler {
   // The eventual output of this stage
@@ -26,6 +38,10 @@ struct Compiler {
   // All incoming string data outlives the compiler, so we can store just views
   std::unordered_map<std::string_view, Ir::Variable> variables;
 
+  // Which expression is being compiled, to tag emitted code with
+  std::vector<Ir::Frame> frames;
+  int current_frame = -1;
+
 
   // =========================================================================
   // Emitting single instructions.
@@ -38,6 +54,7 @@ struct Compiler {
       .dest = dest,
       .src1 = src1,
       .src2 = src2,
+      .frame = current_frame,
     });
     return dest;
   }
@@ -212,37 +229,49 @@ struct Compiler {
     return emit(*op, new_var(), inputs[0], inputs[1]);
   }
 
-  Ir::Constant emit_print_str(Ir::Value str) {
-    // Closest we come to wanting subroutines in the IR/ISA and
-    // functions in the language. Here emits code equivalent to:
-    //
-    //   pointer = str+1;
-    //   counter = *str;
-    //   while (counter) {
-    //     MMIO = *pointer;
-    //     ++pointer;
-    //     --counter;
-    //   }
-
-    Ir::Variable counter = emit_load(new_var(), str);
-    Ir::Variable pointer = emit(Ir::Op::add, new_var(), str, Ir::Constant(1));
+  std::optional<Ir::Value> maybe_emit_vector_op
+  (std::string_view func_name, std::span<const Ir::Value> inputs) {
+    std::optional<Ir::Op> op;
+    if (func_name == "vadd-mem")
+      op = Ir::Op::vadd;
+    else if (func_name == "vsub-mem")
+      op = Ir::Op::vsub;
+    else if (func_name == "vmul-mem")
+      op = Ir::Op::vmul;
+    else if (func_name == "v=-mem")
+      op = Ir::Op::vcmp_equ;
+    else if (func_name == "v>-mem")
+      op = Ir::Op::vcmp_gt;
+    else if (func_name == "v<-mem")
+      op = Ir::Op::vcmp_lt;
 
-    Ir::Variable is_zero = emit(Ir::Op::cmp_equ, new_var(), counter, Ir::Constant(0));
-    Jump_id skip_loop_jump = emit_unpatched_jump(is_zero);
+    if (!op)
+      return std::nullopt;
 
-    Label top = label_here();
-    Ir::Variable character = emit_load(new_var(), pointer);
-    emit_store(character, Ir::Constant(mmio_addr));
+    if (inputs.size() != 3)
+      error("Syntax: ({} DEST A B)", func_name);
 
-    Ir::Variable tmp = new_var();
-    emit(Ir::Op::add, tmp, pointer, Ir::Constant(1));
-    emit_mov(pointer, tmp);
+    // The same as a binop on each of `vector_width` words in a row, through
+    // vector registers that nothing else uses. Gives back DEST
+    emit(Ir::Op::vload, {}, inputs[1], Ir::Constant(0));
+    emit(Ir::Op::vload, {}, inputs[2], Ir::Constant(1));
+    emit(*op, {}, {}, {});
+    emit(Ir::Op::vstore, {}, inputs[0], Ir::Constant(0));
+    return inputs[0];
+  }
 
-    emit(Ir::Op::sub, tmp, counter, Ir::Constant(1));
-    emit_mov(counter, tmp);
-    emit_jump_to(top, counter);
+  Ir::Constant emit_print_str(Ir::Value str) {
+    // The DMA controller does the whole loop by itself, and the packed MMIO
+    // port takes strings of either kind:
+    //
+    //   DMA source = str+1;
+    //   DMA destination = packed MMIO;
+    //   DMA length = *str;
 
-    patch_jump_to_here(skip_loop_jump);
+    Ir::Variable pointer = emit(Ir::Op::add, new_var(), str, Ir::Constant(1));
+    emit_store(pointer, Ir::Constant(dma_src_addr));
+    emit_store(Ir::Constant(mmio_packed_addr), Ir::Constant(dma_dst_addr));
+    emit_store(emit_load(new_var(), str), Ir::Constant(dma_len_addr));
     return Ir::Constant(0);
   }
 
@@ -261,11 +290,15 @@ struct Compiler {
         return Ir::Constant(number.value);
       },
       [&] (Ast::String& string) -> Ir::Value {
-        static_data.reserve(static_data.size() + 1 + string.value.size());
+        // Packed 4 chars to a word, lowest byte first, and the length is in
+        // words. A string made at runtime a char per word is the same to
+        // print-str, whose length is then in chars
+        const uint32_t words = (string.value.size() + 3) / 4;
         uint32_t address = static_data.size();
-        static_data.push_back(string.value.size());
-        for (char c: string.value)
-          static_data.push_back(c);
+        static_data.push_back(words);
+        static_data.resize(static_data.size() + words);
+        for (size_t i = 0; i < string.value.size(); i++)
+          static_data[address + 1 + i / 4] |= uint32_t(uint8_t(string.value[i])) << (8 * (i % 4));
         return Ir::Constant(static_cast<int32_t>(address));
       },
       [&] (Ast::Parens& parens) -> Ir::Value {
@@ -285,6 +318,15 @@ struct Compiler {
       error("Function name must be an identifier");
     std::string_view func_name = func.as<Ast::Identifier>().name;
 
+    const int outer_frame = current_frame;
+    current_frame = int(frames.size());
+    frames.push_back({ .name = func_name, .pos = expr.pos, .parent = outer_frame });
+    Ir::Value result = compile_call(func_name, arguments);
+    current_frame = outer_frame;
+    return result;
+  }
+
+  Ir::Value compile_call(std::string_view func_name, std::span<Ast::Node> arguments) {
     // Intrinsics need access to the AST, so check for them
     // before trying to evaluate arguments
     if (auto intrinsic = maybe_emit_intrinsic(func_name, arguments))
@@ -302,6 +344,9 @@ struct Compiler {
     if (auto lassoc = maybe_emit_lassoc(func_name, inputs))
       return *lassoc;
 
+    if (auto vector_op = maybe_emit_vector_op(func_name, inputs))
+      return *vector_op;
+
     // Kind of intrinsics, but these do evaluate all their arguments
     if (func_name == "progn") {
       if (inputs.empty())
@@ -315,6 +360,32 @@ struct Compiler {
       if (inputs.size() != 2)
         error("Syntax: (write-mem ADDR VALUE)");
       return emit_store(inputs[1], inputs[0]);
+    } else if (func_name == "atomic-add") {
+      if (inputs.size() != 2)
+        error("Syntax: (atomic-add ADDR VALUE)");
+      return emit(Ir::Op::xadd, new_var(), inputs[0], inputs[1]);
+    } else if (func_name == "core-id") {
+      if (!inputs.empty())
+        error("core-id takes no arguments");
+      return emit_load(new_var(), Ir::Constant(core_id_addr));
+    } else if (func_name == "num-cores") {
+      if (!inputs.empty())
+        error("num-cores takes no arguments");
+      return emit_load(new_var(), Ir::Constant(num_cores_addr));
+    } else if (func_name == "ticks" || func_name == "stalled" || func_name == "retired") {
+      if (!inputs.empty())
+        error("{} takes no arguments", func_name);
+      const uint32_t addr = func_name == "ticks" ? ticked_addr
+        : func_name == "stalled" ? stalled_addr : retired_addr;
+      return emit_load(new_var(), Ir::Constant(addr));
+    } else if (func_name == "mark") {
+      if (inputs.size() != 1)
+        error("Syntax: (mark LABEL)");
+      return emit_store(inputs[0], Ir::Constant(marker_addr));
+    } else if (func_name == "vector-width") {
+      if (!inputs.empty())
+        error("vector-width takes no arguments");
+      return Ir::Constant(vector_width);
     } else if (func_name == "print-str") {
       if (inputs.size() != 1)
         error("print-str needs exactly one argument");
@@ -331,10 +402,13 @@ Ir Ir::compile(Ast& ast) {
   Compiler compiler;
 
   // - Reserve a word at 0x0 for a jump to the code
-  // - Reserve 2 more words to guard MMIO against prefetch
+  // - Reserve 2 more words to guard MMIO against prefetch (they read as core info)
   // - Reserve a word at 0x3 for MMIO
-  compiler.static_data.resize(4);
+  // - Reserve 4 for the DMA controller and packed MMIO
+  // - Reserve 4 for the performance counters and the marker
+  compiler.static_data.resize(num_reserved_words);
   assert(mmio_addr < compiler.static_data.size());
+  assert(mmio_packed_addr < compiler.static_data.size());
 
   for (auto& expr: ast.sexprs)
     compiler.compile_parens(expr);
@@ -344,22 +418,32 @@ Ir Ir::compile(Ast& ast) {
   return {
     .code = std::move(compiler.emitted_code),
     .data = std::move(compiler.static_data),
+    .frames = std::move(compiler.frames),
     .num_variables = compiler.next_variable_id,
   };
 }
 
+static bool is_vector_binop(Ir::Op op) {
+  return op >= Ir::Op::vadd && op <= Ir::Op::vcmp_lt;
+}
+
 bool Ir::Insn::has_valid_dest() const {
   return op != Ir::Op::halt
       && op != Ir::Op::jump
-      && op != Ir::Op::store;
+      && op != Ir::Op::store
+      && op != Ir::Op::vload
+      && op != Ir::Op::vstore
+      && !is_vector_binop(op);
 }
 
 bool Ir::Insn::has_valid_src1() const {
-  return op != Ir::Op::halt;
+  return op != Ir::Op::halt
+      && !is_vector_binop(op);
 }
 
 bool Ir::Insn::has_valid_src2() const {
   return op != Ir::Op::halt
       && op != Ir::Op::mov
-      && op != Ir::Op::load;
+      && op != Ir::Op::load
+      && !is_vector_binop(op);
 }
\ No newline at end of file
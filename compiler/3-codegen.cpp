@@ -2,10 +2,13 @@
 #include "stages.hpp"
 #include <algorithm>
 #include <cassert>
+#include <iterator>
 #include <limits>
 #include <numeric>
+#include <ostream>
 #include <ranges>
 #include <span>
+#include <string>
 #include <utility>
 
 namespace {
@@ -145,6 +148,19 @@ enum class Hw_op: uint8_t {
   cmp_lt = 0xA,
   jmp = 0xB,
   jif = 0xC,
+  xadd = 0xD,
+  vec = 0xE,
+};
+
+enum class Hw_vector_op: uint8_t {
+  load = 0x0,
+  store = 0x1,
+  add = 0x2,
+  sub = 0x3,
+  mul = 0x4,
+  cmp_equ = 0x5,
+  cmp_gt = 0x6,
+  cmp_lt = 0x7,
 };
 
 struct Codegen {
@@ -223,9 +239,8 @@ struct Codegen {
   // =========================================================================
   // Emitting HW instructions
 
-  void emit_memop(Hw_op op, Register reg, Location addr) {
-    assert(op == Hw_op::load || op == Hw_op::store);
-    uint32_t high_bits = addr.match(
+  static uint32_t encode_memop_addr(Location addr) {
+    return addr.match(
       [] (Register reg2) -> uint32_t {
         return (1u << 10) | reg2.id << 11;
       },
@@ -235,18 +250,31 @@ struct Codegen {
         return mem.addr << 11;
       }
     );
+  }
 
-    {
-      // HACK: Add 2 nops before every memop.
-      // The processor goes haywire when a memop is within 1 insn forward from
-      // the target of a jump, because both jumps and memops need to stall fetch.
-      // This does not cover *all* cases, but enough for the existing tests to pass.
-      constexpr uint32_t encoded_nop = 0x3 | (1u << 10); // add r0, r0, 0
-      hw_code.push_back(encoded_nop);
-      hw_code.push_back(encoded_nop);
-    }
+  void emit_memop(Hw_op op, Register reg, Location addr) {
+    assert(op == Hw_op::load || op == Hw_op::store || op == Hw_op::xadd);
+    hw_code.push_back(static_cast<uint32_t>(op) | (reg.id << 4) | encode_memop_addr(addr));
+  }
 
-    hw_code.push_back(static_cast<uint32_t>(op) | (reg.id << 4) | high_bits);
+  void emit_vector_memop(Hw_vector_op op, uint8_t vreg, Location addr) {
+    assert(op == Hw_vector_op::load || op == Hw_vector_op::store);
+    hw_code.push_back(
+      static_cast<uint32_t>(Hw_op::vec) |
+      (static_cast<uint32_t>(op) << 4) |
+      (vreg << 7) |
+      encode_memop_addr(addr)
+    );
+  }
+
+  void emit_vector_binop(Hw_vector_op op, uint8_t dest, uint8_t src1, uint8_t src2) {
+    hw_code.push_back(
+      static_cast<uint32_t>(Hw_op::vec) |
+      (static_cast<uint32_t>(op) << 4) |
+      (dest << 7) |
+      (src1 << 10) |
+      (src2 << 13)
+    );
   }
 
   // Follow the "dest, src" convention
@@ -419,6 +447,67 @@ struct Codegen {
     emit_store(reg_of_addr, scratch_reg1);
   }
 
+  // Where a memop finds a pointer: small constants go in the immediate,
+  // and anything else in a register, perhaps loaded into scratch_reg2
+  Location memop_location_of(Ir::Value addr) {
+    return addr.match(
+      [&] (Ir::Constant c) -> Location {
+        if (uint32_t(c.value) < (1u << 21))
+          return Address(uint32_t(c.value));
+        handle_fetch_const(scratch_reg2, c);
+        return scratch_reg2;
+      },
+      [&] (Ir::Variable var) -> Location {
+        if (!is_spilled(var))
+          return reg_of(var);
+        emit_load(scratch_reg2, addr_of(var));
+        return scratch_reg2;
+      }
+    );
+  }
+
+  void handle_xadd(Ir::Variable dest, Ir::Value addr, Ir::Value src) {
+    // Like a store, the value goes into scratch_reg1, and comes back changed
+    src.match(
+      [&] (Ir::Constant c) { handle_fetch_const(scratch_reg1, c); },
+      [&] (Ir::Variable var) {
+        if (is_spilled(var))
+          emit_load(scratch_reg1, addr_of(var));
+        else
+          emit_binop(Hw_op::add, scratch_reg1, reg_of(var), Immediate(0));
+      }
+    );
+
+    emit_memop(Hw_op::xadd, scratch_reg1, memop_location_of(addr));
+    if (is_spilled(dest))
+      emit_store(addr_of(dest), scratch_reg1);
+    else
+      emit_binop(Hw_op::add, reg_of(dest), scratch_reg1, Immediate(0));
+  }
+
+  void handle_vector_op(Ir::Insn& insn) {
+    const auto vector_op = [&] {
+      switch (insn.op) {
+      case Ir::Op::vload: return Hw_vector_op::load;
+      case Ir::Op::vstore: return Hw_vector_op::store;
+      case Ir::Op::vadd: return Hw_vector_op::add;
+      case Ir::Op::vsub: return Hw_vector_op::sub;
+      case Ir::Op::vmul: return Hw_vector_op::mul;
+      case Ir::Op::vcmp_equ: return Hw_vector_op::cmp_equ;
+      case Ir::Op::vcmp_gt: return Hw_vector_op::cmp_gt;
+      case Ir::Op::vcmp_lt: return Hw_vector_op::cmp_lt;
+      default: unreachable();
+      }
+    }();
+
+    if (insn.op == Ir::Op::vload || insn.op == Ir::Op::vstore) {
+      const auto vreg = uint8_t(insn.src2.as<Ir::Constant>().value);
+      emit_vector_memop(vector_op, vreg, memop_location_of(insn.src1));
+    } else {
+      emit_vector_binop(vector_op, 0, 0, 1);
+    }
+  }
+
   void handle_binop(Ir::Insn& insn) {
     Hw_op op = [&] {
       switch (insn.op) {
@@ -490,6 +579,11 @@ struct Codegen {
     case jump: return handle_jump(insn.src1, Address(insn.src2.as<Ir::Constant>().value));
     case load: return handle_load(insn.dest, insn.src1);
     case store: return handle_store(insn.src1, insn.src2);
+    case xadd: return handle_xadd(insn.dest, insn.src1, insn.src2);
+    case vload: case vstore:
+    case vadd: case vsub: case vmul:
+    case vcmp_equ: case vcmp_gt: case vcmp_lt:
+      return handle_vector_op(insn);
     default: return handle_binop(insn);
     }
   }
@@ -516,7 +610,44 @@ Hw_image Hw_image::from_ir(Ir&& ir) {
 
   // Gather result
   Hw_image result;
+  const auto code_offset = uint32_t(codegen.static_data.size());
   result.words = std::move(codegen.static_data);
   result.words.insert(result.words.end(), codegen.hw_code.begin(), codegen.hw_code.end());
+
+  // Every IR insn owns the HW code from its start to the next one's
+  codegen.ir_to_hw_pos.push_back(codegen.hw_code.size());
+  for (uint32_t ir_index = 0; ir_index < code.size(); ir_index++) {
+    for (uint32_t hw_pos = codegen.ir_to_hw_pos[ir_index];
+        hw_pos < codegen.ir_to_hw_pos[ir_index + 1]; hw_pos++) {
+      result.source_map.push_back({
+        .hw_addr = code_offset + hw_pos,
+        .ir_index = ir_index,
+        .frame = code[ir_index].frame,
+      });
+    }
+  }
+  result.frames = std::move(ir.frames);
   return result;
+}
+
+void Hw_image::write_source_map(std::ostream& out) const {
+  std::vector<int> stack;
+  for (const Source_map_entry& entry: source_map) {
+    stack.clear();
+    for (int frame = entry.frame; frame != -1; frame = frames[frame].parent)
+      stack.push_back(frame);
+
+    std::string line = fmt::format("{:#x} {} ", entry.hw_addr, entry.ir_index);
+    if (stack.empty())
+      line += '-';
+    for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+      const Ir::Frame& frame = frames[*it];
+      if (it != stack.rbegin())
+        line += ';';
+      fmt::format_to(std::back_inserter(line), "{}@{}:{}",
+          frame.name, frame.pos.line, frame.pos.column);
+    }
+    line += '\n';
+    out << line;
+  }
 }
\ No newline at end of file
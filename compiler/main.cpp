@@ -4,8 +4,8 @@
 #include <fstream>
 
 int main(int argc, char** argv) {
-  if (argc != 3)
-    error("Usage: {} <victim.lisp> <output-image>", argv[0]);
+  if (argc != 3 && argc != 4)
+    error("Usage: {} <victim.lisp> <output-image> [output-source-map]", argv[0]);
 
   const char* in_filename = argv[1];
   std::ifstream input(in_filename);
@@ -28,4 +28,14 @@ int main(int argc, char** argv) {
   );
   if (!out_stream)
     error("Failed to write image to '{}'", out_filename);
+
+  if (argc == 4) {
+    const char* map_filename = argv[3];
+    std::ofstream map_stream(map_filename);
+    if (!map_stream)
+      error("Cannot open '{}'", map_filename);
+    image.write_source_map(map_stream);
+    if (!map_stream)
+      error("Failed to write source map to '{}'", map_filename);
+  }
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <iosfwd>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // ===========================================================================
@@ -12,11 +13,16 @@
 // (it's more of an Abstract Syntax Forest, though)
 
 struct Ast {
+  struct Source_pos { int line; int column; };
+
   struct Node;
   struct Identifier { std::string name; };
   struct Number { int32_t value; };
   struct String { std::string value; };
-  struct Parens { std::vector<Node> children; };
+  struct Parens {
+    std::vector<Node> children;
+    Source_pos pos; // Of the opening paren
+  };
   struct Node: Either<Identifier, Number, String, Parens> {};
 
   std::vector<Parens> sexprs;
@@ -57,9 +63,20 @@ struct Ir {
     mov,   // no src2
     load,  // no src2
     store, // no dest, src1 is pointer, src2 is value
+    xadd,  // src1 is pointer, src2 is what to add; dest gets what was there
     add, sub, mul, div, mod,
     cmp_equ, cmp_gt, cmp_lt,
     jump, // no dest, src1 is condition, src2 is target (must be Constant)
+    vload, vstore, // no dest, src1 is pointer, src2 is vector register (must be Constant)
+    vadd, vsub, vmul, vcmp_equ, vcmp_gt, vcmp_lt, // nothing: vector registers 0 <- 0 op 1
+  };
+
+  // The (nested) expression an instruction was compiled from. Frames form a tree
+  // through `parent`, which is -1 at the top level
+  struct Frame {
+    std::string_view name; // What is called, points into the AST
+    Ast::Source_pos pos;
+    int parent;
   };
 
   struct Insn {
@@ -67,6 +84,7 @@ struct Ir {
     Variable dest;
     Value src1;
     Value src2;
+    int frame; // Into `frames`, or -1 if not compiled from any expression
 
     bool has_valid_dest() const;
     bool has_valid_src1() const;
@@ -75,6 +93,7 @@ struct Ir {
 
   std::vector<Insn> code;
   std::vector<uint32_t> data;
+  std::vector<Frame> frames;
   int num_variables;
 
   static Ir compile(Ast&);
@@ -93,4 +112,21 @@ struct Ir {
 struct Hw_image {
   std::vector<uint32_t> words;
   static Hw_image from_ir(Ir&&);
+
+  // Where every word of code came from, for the profiler. A text file with a
+  // line per word of code:
+  //
+  //   <hw address> <ir index> <frame>;<frame>;...
+  //
+  // Frames are `name@line:column`, outermost first, or just `-` for code
+  // that no expression asked for
+  struct Source_map_entry {
+    uint32_t hw_addr;
+    uint32_t ir_index;
+    int frame;
+  };
+  std::vector<Source_map_entry> source_map;
+  std::vector<Ir::Frame> frames;
+
+  void write_source_map(std::ostream&) const;
 };
\ No newline at end of file
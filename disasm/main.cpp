@@ -8,6 +8,13 @@ constexpr static std::string_view insn_names[] = {
   "ld", "st",
   "add", "sub", "mul", "div", "mod", "equ", "gt", "lt",
   "jmp", "jif",
+  "xadd",
+};
+
+// Vector insns are named by the op in bits 4-6, see `Vector_op`
+constexpr static std::string_view vector_insn_names[] = {
+  "vld", "vst",
+  "vadd", "vsub", "vmul", "vequ", "vgt", "vlt",
 };
 
 // Either an immediate value or a register ID,
@@ -48,6 +55,7 @@ int main(int argc, char** argv) {
         return fmt::format("{:#x}", insn >> 4);
       case 0x1:
       case 0x2:
+      case 0xD:
         return fmt::format(
           "r{}, mem[{}]",
           (insn >> 4) & 0x3F,
@@ -67,9 +75,21 @@ int main(int argc, char** argv) {
       }
     };
 
+    const auto fmt_vector = [&] () -> std::string {
+      const uint32_t op = (insn >> 4) & 0x7;
+      if (op < 2) {
+        return fmt::format("{} v{}, mem[{}]",
+            vector_insn_names[op], (insn >> 7) & 0x7, Imm_or_reg(insn >> 10));
+      }
+      return fmt::format("{} v{}, v{}, v{}",
+          vector_insn_names[op], (insn >> 7) & 0x7, (insn >> 10) & 0x7, (insn >> 13) & 0x7);
+    };
+
     fmt::print("{:3x}: {:#010x} ", addr, insn);
-    if (opcode < 0xD)
+    if (opcode < 0xE)
       fmt::print("{} {}\n", insn_names[opcode], fmt_operands());
+    else if (opcode == 0xE)
+      fmt::print("{}\n", fmt_vector());
     else
       fmt::print("???\n", insn);
   }
@@ -0,0 +1,294 @@
+#include "lockstep.hpp"
+#include "manifest.hpp"
+#include "mmio.hpp"
+#include "processor.hpp"
+#include "translator.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// ===========================================================================
+// Runs many (image, input, expected output) jobs at once, each on its own
+// simulated processor, spread over all host cores.
+//
+// The manifest (see manifest.hpp) has a job per line:
+//
+//   <image> <stdin file> <expected stdout file>
+//
+// A "-" for stdin means empty input, and for expected output means that any
+// output passes. A line can also be
+//
+//   <image> replay:<recording>
+//
+// for the input and the expected output of a run that `processor --record`
+// made, of an interactive program, say.
+//
+// With `--lockstep`, the jobs of the same image are run together instead, up
+// to `--lanes` of them at a time, see lockstep.hpp. That is the functional
+// model, as with `--fast`, and comes out the same.
+
+namespace {
+
+enum class Mode { pipeline, fast, jit, lockstep };
+
+struct Job {
+  std::string image_path;
+  const std::vector<u32>* image;
+  std::string input;
+  std::optional<std::string> expected_output;
+
+  enum class Result { pass, fail, timeout } result;
+  u64 ticked;
+  u64 stalled;
+};
+
+// Images are often shared between jobs, so each is only read once
+std::vector<Job> read_manifest(const char* filename, std::map<std::string, std::vector<u32>>& images) {
+  const Manifest manifest(filename);
+  std::vector<Job> jobs;
+
+  for (const Manifest::Entry& entry: manifest.entries) {
+    const std::vector<std::string>& fields = entry.fields;
+    const bool replay = fields.size() >= 2 && fields[1].starts_with("replay:");
+    if (fields.size() != (replay ? 2 : 3))
+      FATAL("{}:{}: Expected '<image> <stdin> <expected stdout>'", filename, entry.line_number);
+    const std::string& image = fields[0];
+
+    auto [it, inserted] = images.try_emplace(image);
+    if (inserted)
+      it->second = read_image(manifest.path(image));
+
+    if (replay) {
+      const std::string recording = manifest.path(fields[1].substr(fields[1].find(':') + 1)).string();
+      const Mmio_log log = Mmio_log::load(recording.c_str());
+      jobs.push_back(Job{
+        .image_path = image,
+        .image = &it->second,
+        .input = log.input(),
+        .expected_output = log.output(),
+        .result = {},
+        .ticked = 0,
+        .stalled = 0,
+      });
+      continue;
+    }
+
+    const std::string& input = fields[1];
+    const std::string& expected = fields[2];
+    jobs.push_back(Job{
+      .image_path = image,
+      .image = &it->second,
+      .input = (input == "-") ? std::string() : read_whole_file(manifest.path(input)),
+      .expected_output = (expected == "-")
+        ? std::nullopt
+        : std::optional(read_whole_file(manifest.path(expected))),
+      .result = {},
+      .ticked = 0,
+      .stalled = 0,
+    });
+  }
+  return jobs;
+}
+
+void finish_job(Job& job, const Buffer_mmio& io, bool timed_out) {
+  if (timed_out)
+    job.result = Job::Result::timeout;
+  else if (job.expected_output && *job.expected_output != io.output)
+    job.result = Job::Result::fail;
+  else
+    job.result = Job::Result::pass;
+}
+
+void run_job(Job& job, Mode mode, u64 max_ticks) {
+  Buffer_mmio io(std::move(job.input));
+  Processor proc(*job.image, io);
+
+  bool timed_out = false;
+  switch (mode) {
+  case Mode::pipeline:
+    while (proc.next_tick<false>(max_ticks - proc.stats.ticked)) {
+      if (proc.stats.ticked >= max_ticks) {
+        timed_out = true;
+        break;
+      }
+    }
+    break;
+  case Mode::fast:
+    while (proc.next_insn()) {
+      if (proc.stats.ticked >= max_ticks) {
+        timed_out = true;
+        break;
+      }
+    }
+    break;
+  case Mode::jit:
+    timed_out = Translator(proc).run(max_ticks);
+    break;
+  case Mode::lockstep:
+    FATAL("Lockstep jobs are run together, see `run_lockstep()`");
+  }
+
+  job.ticked = proc.stats.ticked;
+  job.stalled = proc.stats.stalled;
+  finish_job(job, io, timed_out);
+}
+
+// Jobs that all have the same image
+void run_lockstep(std::span<Job* const> jobs, u64 max_ticks) {
+  std::vector<Buffer_mmio> ios;
+  ios.reserve(jobs.size());
+  std::vector<Mmio*> lanes;
+  for (Job* job: jobs)
+    lanes.push_back(&ios.emplace_back(std::move(job->input)));
+
+  Lockstep lockstep(*jobs.front()->image, lanes);
+  lockstep.run(max_ticks);
+
+  for (size_t l = 0; l < jobs.size(); l++) {
+    jobs[l]->ticked = lockstep.ticked[l];
+    jobs[l]->stalled = lockstep.stalled[l];
+    finish_job(*jobs[l], ios[l], lockstep.state[l] == Lockstep::Lane_state::timed_out);
+  }
+}
+
+// Up to `lanes` jobs at a time of the same image, in the order of the manifest otherwise
+std::vector<std::vector<Job*>> group_by_image(std::vector<Job>& jobs, u32 lanes) {
+  std::map<const std::vector<u32>*, std::vector<Job*>> by_image;
+  std::vector<std::vector<Job*>> groups;
+  for (Job& job: jobs) {
+    std::vector<Job*>& group = by_image[job.image];
+    group.push_back(&job);
+    if (group.size() == lanes)
+      groups.push_back(std::exchange(group, {}));
+  }
+  for (Job& job: jobs) {
+    std::vector<Job*>& group = by_image[job.image];
+    if (!group.empty())
+      groups.push_back(std::exchange(group, {}));
+  }
+  return groups;
+}
+
+// Every worker has its own queue, taking from the back of it, and when it
+// runs dry steals from the front of someone else's
+struct Pool {
+  struct Queue {
+    std::mutex lock;
+    std::deque<size_t> jobs;
+  };
+  std::vector<Queue> queues;
+
+  explicit Pool(size_t num_workers, size_t num_jobs): queues(num_workers) {
+    for (size_t i = 0; i < num_jobs; i++)
+      queues[i % num_workers].jobs.push_back(i);
+  }
+
+  std::optional<size_t> take(size_t worker) {
+    {
+      Queue& own = queues[worker];
+      std::lock_guard guard(own.lock);
+      if (!own.jobs.empty()) {
+        size_t job = own.jobs.back();
+        own.jobs.pop_back();
+        return job;
+      }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+      Queue& victim = queues[(worker + i) % queues.size()];
+      std::lock_guard guard(victim.lock);
+      if (!victim.jobs.empty()) {
+        size_t job = victim.jobs.front();
+        victim.jobs.pop_front();
+        return job;
+      }
+    }
+    return std::nullopt; // Nobody adds jobs after the start, so this is the end
+  }
+};
+
+void usage(const char* argv0) {
+  FATAL("Usage: {} [--fast | --jit | --lockstep] [--lanes=N] [--jobs=N] [--max-ticks=N] <manifest>", argv0);
+}
+
+} // anon namespace
+
+int main(int argc, char** argv) {
+  const char* manifest_filename = nullptr;
+  Mode mode = Mode::pipeline;
+  size_t num_workers = std::max(1u, std::thread::hardware_concurrency());
+  u64 max_ticks = std::numeric_limits<u64>::max();
+  u32 lanes = 64;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    std::string_view value = arg.substr(arg.find('=') + 1);
+    if (arg == "--fast")
+      mode = Mode::fast;
+    else if (arg == "--jit")
+      mode = Mode::jit;
+    else if (arg == "--lockstep")
+      mode = Mode::lockstep;
+    else if (arg.starts_with("--lanes="))
+      lanes = std::max(1u, util::parse_number(value));
+    else if (arg.starts_with("--jobs="))
+      num_workers = std::max(1u, util::parse_number(value));
+    else if (arg.starts_with("--max-ticks="))
+      max_ticks = util::parse_number<u64>(value);
+    else if (!arg.starts_with("--") && !manifest_filename)
+      manifest_filename = argv[i];
+    else
+      usage(argv[0]);
+  }
+  if (!manifest_filename)
+    usage(argv[0]);
+
+  std::map<std::string, std::vector<u32>> images;
+  std::vector<Job> jobs = read_manifest(manifest_filename, images);
+
+  // The pool hands out groups of jobs instead, if they are run in lockstep
+  const auto groups = mode == Mode::lockstep
+    ? group_by_image(jobs, lanes)
+    : std::vector<std::vector<Job*>>{};
+  const size_t num_tasks = mode == Mode::lockstep ? groups.size() : jobs.size();
+
+  num_workers = std::min(num_workers, std::max<size_t>(num_tasks, 1));
+  Pool pool(num_workers, num_tasks);
+  {
+    std::vector<std::jthread> workers;
+    for (size_t w = 0; w < num_workers; w++) {
+      workers.emplace_back([&, w] {
+        while (auto task = pool.take(w)) {
+          if (mode == Mode::lockstep)
+            run_lockstep(groups[*task], max_ticks);
+          else
+            run_job(jobs[*task], mode, max_ticks);
+        }
+      });
+    }
+  }
+
+  int num_failed = 0;
+  for (const Job& job: jobs) {
+    const char* verdict = "PASS";
+    if (job.result == Job::Result::fail)
+      verdict = "FAIL";
+    else if (job.result == Job::Result::timeout)
+      verdict = "TIMEOUT";
+    if (job.result != Job::Result::pass)
+      num_failed++;
+    fmt::print(FMT_STRING("{:7} {} ticked: {}, stalled: {}\n"),
+        verdict, job.image_path, job.ticked, job.stalled);
+  }
+  fmt::print(FMT_STRING("{} of {} jobs passed\n"), jobs.size() - num_failed, jobs.size());
+  return num_failed == 0 ? 0 : 1;
+}
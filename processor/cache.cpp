@@ -0,0 +1,35 @@
+#include "cache.hpp"
+#include <bit>
+
+void Cache::configure(const timing::Cache_config& c) {
+  config = c;
+  stats = {};
+  uses = 0;
+  lines.assign(config.size / config.line, Line{});
+  line_bits = std::countr_zero(config.line);
+  set_mask = config.size / (config.ways * config.line) - 1;
+}
+
+uint32_t Cache::access(uint32_t addr) {
+  const uint32_t line_number = addr >> line_bits;
+  const uint32_t tag = line_number >> std::popcount(set_mask);
+  Line* const set = &lines[(line_number & set_mask) * config.ways];
+  uses++;
+
+  Line* victim = set;
+  for (uint32_t way = 0; way < config.ways; way++) {
+    Line& line = set[way];
+    if (line.valid && line.tag == tag) {
+      line.last_used = uses;
+      stats.hits++;
+      return config.hit_latency;
+    }
+    if (!line.valid || (victim->valid && line.last_used < victim->last_used))
+      victim = &line;
+  }
+
+  *victim = { .tag = tag, .valid = true, .last_used = uses };
+  stats.misses++;
+  stats.miss_ticks += config.miss_latency - config.hit_latency;
+  return config.miss_latency;
+}
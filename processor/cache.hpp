@@ -0,0 +1,37 @@
+#pragma once
+#include "timing.hpp"
+#include <cstdint>
+#include <vector>
+
+// ===========================================================================
+// L1 cache model.
+//
+// Only tells how long an access takes, the data itself always comes straight
+// from memory. Set-associative with LRU replacement; stores allocate a line
+// the same as loads do, and writing lines back is not accounted for.
+
+struct Cache {
+  void configure(const timing::Cache_config&);
+  bool enabled() const { return !lines.empty(); }
+
+  uint32_t access(uint32_t addr); // returns: ticks it takes
+
+  struct {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t miss_ticks = 0; // Held for, over what a hit would have taken
+  } stats;
+
+  struct Line {
+    uint32_t tag;
+    bool valid;
+    uint64_t last_used;
+  };
+  std::vector<Line> lines; // `ways` in a row for each set
+  uint64_t uses = 0;
+
+private:
+  timing::Cache_config config;
+  uint32_t line_bits = 0;
+  uint32_t set_mask = 0;
+};
@@ -0,0 +1,201 @@
+#include "isa.hpp"
+#include "processor.hpp"
+#include <algorithm>
+#include <utility>
+
+// ===========================================================================
+// Functional model.
+//
+// Executes whole instructions against the architectural state, skipping the
+// fetch/decode/execute muxes. It is the same machine as far as the program can
+// tell, but nowhere near the same amount of work for the host.
+//
+// Ticks are not simulated, only estimated with the same rules the pipeline
+// follows: a jmp is 3 stalled ticks, a taken jif is 1 + 2 stalled, a memop
+// holds fetch for an extra tick, and everything else takes a single tick.
+//
+// The extra tick of a memop is a bubble after the instruction that follows it,
+// so what it costs depends on that instruction: the bubble of a jmp or a taken
+// jif swallows it, a halt never gets to it, and otherwise it is 1 stalled tick.
+// Two memops in a row have both their bubbles right after the second one.
+//
+// Whatever the timing config adds on top of that (see timing.hpp) holds the
+// pipeline as a whole, so it is just so many more stalled ticks, except for
+// a pipelined mul or div: then, what it costs depends on when its result is
+// first used, which is told by the tick each register is ready at.
+
+bool Processor::next_insn() {
+  if (stats.ticked == 0) // Account for the pipeline filling up before the first insn
+    stats.ticked = timing::pipeline_fill;
+
+  const u32 insn = mem.fetch(functional.insn_pointer);
+  const auto opcode = static_cast<Opcode>(insn & 0xF);
+  u32* const regs = reg.registers;
+
+  u32 next_pointer = functional.insn_pointer + 1;
+  int ticks = 1;
+  int stalls = 0;
+  auto stall_cause = timing::Stall::memop;
+  const bool after_memop = std::exchange(functional.after_memop, false);
+
+  const auto stall_for = [&] (timing::Stall cause, u64 n) {
+    stats.ticked += n;
+    stats.stalled += n;
+    stats.stalled_on[int(cause)] += n;
+  };
+
+  const bool scoreboarded = timing_config.scoreboarded();
+  if (scoreboarded) {
+    u64 ready = 0;
+    const auto operand = [&] (u32 regid) { ready = std::max(ready, reg.ready_at[regid]); };
+    switch (opcode) {
+    case Opcode::halt:
+    case Opcode::jmp:
+      break;
+    case Opcode::load:
+    case Opcode::store:
+    case Opcode::xadd:
+      if (insn & (1u << 10))
+        operand((insn >> 11) & 0x3F);
+      if (opcode != Opcode::load)
+        operand((insn >> 4) & 0x3F);
+      break;
+    case Opcode::jif:
+      operand((insn >> 4) & 0x3F);
+      break;
+    case Opcode::vec: {
+      // Vector registers are always ready, only an address register can be waited on
+      const auto op = static_cast<Vector_op>((insn >> 4) & 0x7);
+      if ((op == Vector_op::load || op == Vector_op::store) && (insn & (1u << 10)))
+        operand((insn >> 11) & 0x3F);
+      break;
+    }
+    default:
+      if (insn & (1u << 10))
+        operand((insn >> 11) & 0x3F);
+      if (insn & (1u << 21))
+        operand((insn >> 22) & 0x3F);
+      break;
+    }
+    if (ready > stats.ticked)
+      stall_for(timing::Stall::muldiv, ready - stats.ticked);
+  }
+  const u64 executed_at = stats.ticked;
+  u64 held = 0;
+  auto held_on = timing::Stall::memory;
+
+  const auto memop_timing = [&] (u32 words) {
+    if (after_memop) {
+      // Nothing got fetched between two memops, so both bubbles come right
+      // after the second one, and there is nothing left to swallow them
+      ticks = 1 + 2 * (timing::memop_ticks - 1);
+      stalls = 2 * (timing::memop_ticks - 1);
+    } else {
+      ticks = timing::memop_ticks - 1;
+      functional.after_memop = true;
+    }
+    // ... and a DMA transfer that a store starts goes on to keep memory busy
+    if (mem.dma.len)
+      mem.run_dma();
+    held = (words + std::exchange(mem.dma.accesses, 0)) * timing_config.memory_latency - 1;
+  };
+
+  switch (opcode) {
+  case Opcode::halt:
+    return false;
+
+  case Opcode::load:
+  case Opcode::store:
+  case Opcode::xadd: {
+    const u32 addr = (insn & (1u << 10))
+      ? regs[(insn >> 11) & 0x3F]
+      : (insn >> 11);
+    u32& data_reg = regs[(insn >> 4) & 0x3F];
+    if (opcode != Opcode::store) {
+      const u32 old = mem.read(addr);
+      if (opcode == Opcode::xadd)
+        mem.write(addr, old + data_reg);
+      data_reg = old;
+      if (scoreboarded)
+        reg.ready_at[(insn >> 4) & 0x3F] = 0;
+    } else {
+      mem.write(addr, data_reg);
+    }
+    memop_timing(1);
+    break;
+  }
+
+  case Opcode::vec: {
+    const auto op = static_cast<Vector_op>((insn >> 4) & 0x7);
+    u32* const vreg = reg.vectors[(insn >> 7) & 0x7];
+    if (op == Vector_op::load || op == Vector_op::store) {
+      const u32 addr = (insn & (1u << 10))
+        ? regs[(insn >> 11) & 0x3F]
+        : (insn >> 11);
+      for (u32 i = 0; i < vector_width; i++) {
+        if (op == Vector_op::load)
+          vreg[i] = mem.read(addr + i);
+        else
+          mem.write(addr + i, vreg[i]);
+      }
+      memop_timing(vector_width);
+    } else {
+      const u32* const vsrc1 = reg.vectors[(insn >> 10) & 0x7];
+      const u32* const vsrc2 = reg.vectors[(insn >> 13) & 0x7];
+      const auto alu_op = Alu::op_of_vector_op(op);
+      for (u32 i = 0; i < vector_width; i++)
+        vreg[i] = Alu::compute(alu_op, vsrc1[i], vsrc2[i]);
+    }
+    break;
+  }
+
+  case Opcode::jmp:
+    next_pointer = insn >> 4;
+    ticks = stalls = timing::jmp_stall;
+    stall_cause = held_on = timing::Stall::jump;
+    held = timing_config.jump_penalty;
+    break;
+
+  case Opcode::jif:
+    if (regs[(insn >> 4) & 0x3F] != 0) {
+      next_pointer = insn >> 10;
+      stalls = timing::jif_taken_stall;
+      ticks += stalls;
+      stall_cause = held_on = timing::Stall::jump;
+      held = timing_config.jump_penalty;
+    }
+    break;
+
+  default: {
+    // Binop
+    const auto operand = [&] (u32 encoded) {
+      return (encoded & 1u) ? regs[(encoded >> 1) & 0x3F] : (encoded >> 1);
+    };
+    const u32 src1 = operand((insn >> 10) & 0x7FF);
+    const u32 src2 = operand((insn >> 21) & 0x7FF);
+    const auto op = Alu::op_of_binop(insn & 0xF);
+    regs[(insn >> 4) & 0x3F] = Alu::compute(op, src1, src2);
+    if (scoreboarded) {
+      reg.ready_at[(insn >> 4) & 0x3F] = executed_at + alu_latency(op);
+    } else if (!timing_config.muldiv_pipelined) {
+      held = alu_latency(op) - 1;
+      held_on = timing::Stall::muldiv;
+    }
+    break;
+  }
+  }
+
+  // Settle the previous memop's extra tick, now that we know what came after it
+  if (after_memop && stalls == 0) {
+    ticks++;
+    stalls++;
+  }
+
+  functional.insn_pointer = next_pointer;
+  stats.retired++;
+  stats.ticked += ticks;
+  stats.stalled += stalls;
+  stats.stalled_on[int(stall_cause)] += stalls;
+  stall_for(held_on, held);
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+
+// The instruction set, as far as the encoding is concerned.
+// Both the pipeline model and the functional model decode from these.
+
+enum class Opcode {
+  halt = 0x0,
+  load = 0x1,
+  store = 0x2,
+  add = 0x3,
+  sub = 0x4,
+  mul = 0x5,
+  div = 0x6,
+  mod = 0x7,
+  cmp_equ = 0x8,
+  cmp_gt = 0x9,
+  cmp_lt = 0xA,
+  jmp = 0xB,
+  jif = 0xC,
+  xadd = 0xD, // Atomically adds the register to memory, and gets what was there before
+  vec = 0xE, // One of `Vector_op`, in bits 4-6
+};
+
+// Vector insns work on `vector_width` words at once, in vector registers of
+// their own. A load or store is encoded as a memop, with the vector register
+// in bits 7-9, and moves that many consecutive words starting at the address.
+// The rest take a vector register for the result in bits 7-9, and the two
+// operands in bits 10-12 and 13-15, and do the same as a binop in every lane
+enum class Vector_op {
+  load = 0x0,
+  store = 0x1,
+  add = 0x2,
+  sub = 0x3,
+  mul = 0x4,
+  cmp_equ = 0x5,
+  cmp_gt = 0x6,
+  cmp_lt = 0x7,
+};
+constexpr uint32_t vector_width = 4;
+constexpr uint32_t num_vector_registers = 8;
+
+// MMIO inside memory manager is magic
+constexpr uint32_t mmio_addr = 0x3;
+
+// ... and so are these, which a load reads as how many cores there are and
+// which one is reading (see multicore.hpp). Writes to them are dropped. Fetch
+// still sees the words in memory, so they can guard MMIO as they always have
+constexpr uint32_t num_cores_addr = 0x1;
+constexpr uint32_t core_id_addr = 0x2;
+
+// A DMA controller. Writing a length copies that many words from the source
+// to the destination right away, and holds the pipeline for as long as the
+// memory port is busy with it. The MMIO port takes no memory, and is not
+// stepped past, so a transfer to it prints and one from it reads input. The
+// source and destination read as where the last transfer left off
+constexpr uint32_t dma_src_addr = 0x4;
+constexpr uint32_t dma_dst_addr = 0x5;
+constexpr uint32_t dma_len_addr = 0x6;
+
+// A second MMIO port, for strings packed 4 chars to a word. A store to it
+// pushes every nonzero byte of the word, lowest first, so a word with a
+// single char in it prints the same as through `mmio_addr`. Like that one,
+// the DMA does not step past it. Loads read 0
+constexpr uint32_t mmio_packed_addr = 0x7;
+
+constexpr bool is_mmio_port(uint32_t addr) { return addr == mmio_addr || addr == mmio_packed_addr; }
+
+// Performance counters, for a program to time itself with. Loads read the low
+// 32 bits of how many ticks have gone by so far, how many of them were stalled,
+// and how many insns were executed before this one, as the model running it
+// counts them (see `Processor::stats`). Stores to them are dropped
+constexpr uint32_t ticked_addr = 0x8;
+constexpr uint32_t stalled_addr = 0x9;
+constexpr uint32_t retired_addr = 0xA;
+
+// A store here has the host write down the tick it happened on, labelled with
+// the stored word, if it was asked to (`processor --markers`). Loads read 0
+constexpr uint32_t marker_addr = 0xB;
+
+// Loads and stores below this are not to plain memory
+constexpr uint32_t num_reserved_words = 0xC;
+
+// Timing rules of the pipeline, which the functional model has to mimic
+// when it estimates how long the program would have run
+namespace timing {
+constexpr int pipeline_fill = 3; // Ticks before the first real instruction executes
+constexpr int jmp_stall = 3;
+constexpr int jif_taken_stall = 2;
+constexpr int memop_ticks = 2;
+// Memory moves a word at a time, so a vector memop holds the pipeline while
+// it moves the other `vector_width - 1`. Lanes have adders and multipliers of
+// their own, which always take a single tick, whatever the timing config says
+}
\ No newline at end of file
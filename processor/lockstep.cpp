@@ -0,0 +1,371 @@
+#include "lockstep.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace {
+
+// `m ? x : y`, for a lane that is in the group or not. Written out with a mask,
+// since gcc makes a ternary into a store that is only done sometimes, and then
+// does not vectorize the loop
+template<typename T>
+T pick(u8 m, T x, T y) {
+  const T keep = T(m) - 1; // All ones if not in the group
+  return (x & ~keep) | (y & keep);
+}
+
+} // anon namespace
+
+Lockstep::Lockstep(std::span<const u32> image, std::span<Mmio* const> ios, const timing::Config& config) {
+  // Results are only ever waited for by the pipeline and `next_insn()`
+  if (config.scoreboarded())
+    FATAL("Lockstep cannot do a pipelined mul or div");
+  lanes = u32(ios.size());
+  timing_config = config;
+
+  state.assign(lanes, Lane_state::running);
+  // As if the pipeline had already filled up, see `next_insn()`
+  ticked.assign(lanes, timing::pipeline_fill);
+  stalled.assign(lanes, 0);
+  stalled_on.assign(timing::num_stall_causes * lanes, 0);
+  retired.assign(lanes, 0);
+  insn_pointer.assign(lanes, 0);
+  after_memop.assign(lanes, 0);
+  registers.assign(64 * lanes, 0);
+  vectors.assign(num_vector_registers * vector_width * lanes, 0);
+  for (Mmio* io: ios) {
+    Processor::Mem& m = mem.emplace_back();
+    m.memory = Processor::load_image(image);
+    m.mmio = io;
+    m.core_id = 0;
+    m.num_cores = 1;
+    const u32 l = u32(mem.size() - 1);
+    m.counters.ticked = &ticked[l];
+    m.counters.stalled = &stalled[l];
+    m.counters.retired = &retired[l];
+  }
+
+  code.assign(image.begin(), image.end());
+  written.assign(image.size(), 0);
+  in_group.assign(lanes, 0);
+  fetched.assign(lanes, 0);
+  scratch1.assign(lanes, 0);
+  scratch2.assign(lanes, 0);
+}
+
+void Lockstep::run(u64 max_ticks) {
+  const u32 n = lanes;
+  Lane_state* const states = state.data();
+  const u32* const ip = insn_pointer.data();
+  const u64* const ticks = ticked.data();
+  u8* const mask = in_group.data();
+
+  // No lane has ticked more than this. The host has nothing to compare 64-bit
+  // numbers with over many lanes at once, so they are only looked at once it is
+  // near `max_ticks`
+  u64 most_ticked = *std::max_element(ticks, ticks + n);
+
+  for (;;) {
+    constexpr u32 nowhere = std::numeric_limits<u32>::max();
+    u32 pc = nowhere;
+    u32 running = 0;
+    for (u32 l = 0; l < n; l++) {
+      const u8 r = states[l] == Lane_state::running;
+      pc = std::min(pc, pick(r, ip[l], nowhere));
+      running += r;
+    }
+    if (running == 0)
+      return;
+
+    u32 size = 0;
+    for (u32 l = 0; l < n; l++) {
+      mask[l] = (states[l] == Lane_state::running) & (ip[l] == pc);
+      size += mask[l];
+    }
+    group_size = size;
+
+    if (pc < code.size() && !written[pc] && pc != mmio_addr) {
+      // Nobody wrote there, so it is still the image's, and the same for everyone
+      fill_group();
+      most_ticked += step(pc, code[pc]);
+    } else {
+      // Any lane can have something else there, and those that do go on by themselves
+      waiting.clear();
+      for (u32 l = 0; l < lanes; l++) {
+        if (in_group[l]) {
+          waiting.push_back(l);
+          fetched[l] = mem[l].fetch(pc);
+          in_group[l] = 0;
+        }
+      }
+      u64 most = 0;
+      while (!waiting.empty()) {
+        const u32 insn = fetched[waiting.front()];
+        group_size = 0;
+        for (u32 l: waiting)
+          group_size += in_group[l] = fetched[l] == insn;
+        std::erase_if(waiting, [&] (u32 l) { return in_group[l]; });
+        fill_group();
+        most = std::max(most, step(pc, insn));
+        for (u32 l: group)
+          in_group[l] = 0;
+      }
+      most_ticked += most;
+    }
+
+    if (most_ticked >= max_ticks) {
+      most_ticked = 0;
+      for (u32 l = 0; l < n; l++) {
+        if (states[l] != Lane_state::running)
+          continue;
+        if (ticks[l] >= max_ticks)
+          states[l] = Lane_state::timed_out;
+        else
+          most_ticked = std::max(most_ticked, ticks[l]);
+      }
+    }
+  }
+}
+
+void Lockstep::fill_group() {
+  // Only ever looked at if there are few enough lanes in it, see `each()`
+  group.clear();
+  if (!wide()) {
+    for (u32 l = 0; l < lanes && group.size() < group_size; l++) {
+      if (in_group[l])
+        group.push_back(l);
+    }
+  }
+}
+
+// Calls `f(lane, in_group)` for the lanes of the group. When it has most of the
+// lanes, that is done for all of them instead, for the loop to vectorize, and
+// then `f` has to leave alone the lanes that are not in it
+template<typename F>
+void Lockstep::each(F&& f) {
+  if (wide()) {
+    // Copied out, or else every store through a u32* could have changed them
+    const u32 n = lanes;
+    const u8* const mask = in_group.data();
+    // Lanes never see each other, but gcc would not check that many arrays for overlap
+#pragma GCC ivdep
+    for (u32 l = 0; l < n; l++)
+      f(l, mask[l]);
+  } else {
+    for (u32 l: group)
+      f(l, u8(1));
+  }
+}
+
+// ... and `f(lane)` for just the lanes of the group, which is not going to vectorize anyway
+template<typename F>
+void Lockstep::each_scalar(F&& f) {
+  if (wide()) {
+    for (u32 l = 0; l < lanes; l++) {
+      if (in_group[l])
+        f(l);
+    }
+  } else {
+    for (u32 l: group)
+      f(l);
+  }
+}
+
+u64 Lockstep::step(u32 pc, u32 insn) {
+  using Op = Processor::Alu::Op;
+  const auto opcode = static_cast<Opcode>(insn & 0xF);
+  // Straight at the lanes, for the loops over them to vectorize (see `each()`)
+  u32* const ip = insn_pointer.data();
+  u8* const after = after_memop.data();
+  u64* const ticks = ticked.data();
+  u64* const stalls = stalled.data();
+  u64* const insns = retired.data();
+  u64* const on_jump = &stalled_on[int(timing::Stall::jump) * lanes];
+  u64* const on_memop = &stalled_on[int(timing::Stall::memop) * lanes];
+  u64* const on_muldiv = &stalled_on[int(timing::Stall::muldiv) * lanes];
+
+  // Any insn that goes on to the next one, and settles the extra tick of a memop before it
+  const auto go_on = [&] (u64 held) {
+    each([&] (u32 l, u8 m) {
+      const u64 settle = m & after[l];
+      ip[l] = pick(m, pc + 1, ip[l]);
+      after[l] = pick<u8>(m, 0, after[l]);
+      ticks[l] += m * (1 + held) + settle;
+      stalls[l] += m * held + settle;
+      on_memop[l] += settle;
+      on_muldiv[l] += m * held;
+      insns[l] += m;
+    });
+  };
+
+  switch (opcode) {
+  case Opcode::halt:
+    each_scalar([&] (u32 l) { state[l] = Lane_state::halted; });
+    return 0;
+
+  case Opcode::load:
+  case Opcode::store:
+  case Opcode::xadd: {
+    u64 most = 0;
+    each_scalar([&] (u32 l) { most = std::max(most, memop(l, insn)); });
+    return most;
+  }
+
+  case Opcode::vec: {
+    const auto op = static_cast<Vector_op>((insn >> 4) & 0x7);
+    if (op == Vector_op::load || op == Vector_op::store) {
+      u64 most = 0;
+      each_scalar([&] (u32 l) { most = std::max(most, memop(l, insn)); });
+      return most;
+    }
+    const auto alu_op = Processor::Alu::op_of_vector_op(op);
+    for (u32 i = 0; i < vector_width; i++) {
+      alu(alu_op, vec((insn >> 7) & 0x7, i),
+          vec((insn >> 10) & 0x7, i), vec((insn >> 13) & 0x7, i));
+    }
+    go_on(0);
+    return 2;
+  }
+
+  case Opcode::jmp: {
+    // Swallows the bubble of a memop before it, if any
+    const u32 target = insn >> 4;
+    const u64 stall = timing::jmp_stall + timing_config.jump_penalty;
+    each([&] (u32 l, u8 m) {
+      ip[l] = pick(m, target, ip[l]);
+      after[l] = pick<u8>(m, 0, after[l]);
+      ticks[l] += m * stall;
+      stalls[l] += m * stall;
+      on_jump[l] += m * stall;
+      insns[l] += m;
+    });
+    return stall;
+  }
+
+  case Opcode::jif: {
+    const u32* const cond = reg((insn >> 4) & 0x3F);
+    const u32 target = insn >> 10;
+    const u64 penalty = timing_config.jump_penalty;
+    each([&] (u32 l, u8 m) {
+      const u64 taken = m & (cond[l] != 0);
+      const u64 settle = m & !taken & after[l];
+      const u64 jump = taken * (timing::jif_taken_stall + penalty);
+      ip[l] = pick(m, taken ? target : pc + 1, ip[l]);
+      after[l] = pick<u8>(m, 0, after[l]);
+      ticks[l] += m + jump + settle;
+      stalls[l] += jump + settle;
+      on_jump[l] += jump;
+      on_memop[l] += settle;
+      insns[l] += m;
+    });
+    return 1 + std::max<u64>(timing::jif_taken_stall + penalty, 1);
+  }
+
+  default: {
+    // Binop. An immediate is spread over the lanes, so that both operands are the same to `alu()`
+    const auto operand = [&] (u32 encoded, std::vector<u32>& scratch) -> const u32* {
+      if (encoded & 1u)
+        return reg((encoded >> 1) & 0x3F);
+      const u32 imm = encoded >> 1;
+      u32* const spread = scratch.data();
+      each([&] (u32 l, u8) { spread[l] = imm; });
+      return spread;
+    };
+    const u32* const src1 = operand((insn >> 10) & 0x7FF, scratch1);
+    const u32* const src2 = operand((insn >> 21) & 0x7FF, scratch2);
+    const auto op = Processor::Alu::op_of_binop(insn & 0xF);
+    alu(op, reg((insn >> 4) & 0x3F), src1, src2);
+
+    u32 latency = 1;
+    if (op == Op::mul)
+      latency = timing_config.mul_latency;
+    else if (op == Op::div || op == Op::mod)
+      latency = timing_config.div_latency;
+    go_on(latency - 1);
+    return 1 + latency;
+  }
+  }
+}
+
+void Lockstep::alu(Processor::Alu::Op op, u32* dest, const u32* src1, const u32* src2) {
+  using Op = Processor::Alu::Op;
+  // The same as `Alu::compute()`, but with the op known to the loop
+  const auto apply = [&] (auto f) {
+    each([&] (u32 l, u8 m) {
+      const u32 result = f(src1[l], src2[l], m);
+      dest[l] = pick(m, result, dest[l]);
+    });
+  };
+  switch (op) {
+  case Op::add: apply([] (u32 a, u32 b, u8) { return a + b; }); break;
+  case Op::sub: apply([] (u32 a, u32 b, u8) { return a - b; }); break;
+  case Op::mul: apply([] (u32 a, u32 b, u8) { return a * b; }); break;
+  // Lanes outside the group must not divide by zero, whatever they have there
+  case Op::div: apply([] (u32 a, u32 b, u8 m) { return a / (m ? b : 1); }); break;
+  case Op::mod: apply([] (u32 a, u32 b, u8 m) { return a % (m ? b : 1); }); break;
+  case Op::equ: apply([] (u32 a, u32 b, u8) { return u32(a == b); }); break;
+  case Op::lt: apply([] (u32 a, u32 b, u8) { return u32(a < b); }); break;
+  case Op::gt: apply([] (u32 a, u32 b, u8) { return u32(a > b); }); break;
+  }
+}
+
+u64 Lockstep::memop(u32 l, u32 insn) {
+  Processor::Mem& m = mem[l];
+  const auto opcode = static_cast<Opcode>(insn & 0xF);
+  const u32 addr = (insn & (1u << 10))
+    ? reg((insn >> 11) & 0x3F)[l]
+    : (insn >> 11);
+
+  u32 words = 1;
+  if (opcode == Opcode::vec) {
+    const bool load = static_cast<Vector_op>((insn >> 4) & 0x7) == Vector_op::load;
+    for (u32 i = 0; i < vector_width; i++) {
+      u32& word = vec((insn >> 7) & 0x7, i)[l];
+      if (load) {
+        word = m.read(addr + i);
+      } else {
+        m.write(addr + i, word);
+        wrote(addr + i);
+      }
+    }
+    words = vector_width;
+  } else {
+    u32& data_reg = reg((insn >> 4) & 0x3F)[l];
+    if (opcode != Opcode::store) {
+      const u32 old = m.read(addr);
+      if (opcode == Opcode::xadd) {
+        m.write(addr, old + data_reg);
+        wrote(addr);
+      }
+      data_reg = old;
+    } else {
+      m.write(addr, data_reg);
+      wrote(addr);
+    }
+  }
+
+  // Same as `memop_timing` in `next_insn()`
+  u64 ticks = timing::memop_ticks - 1;
+  u64 stalls = 0;
+  if (std::exchange(after_memop[l], 0)) {
+    ticks = 1 + 2 * (timing::memop_ticks - 1);
+    stalls = 2 * (timing::memop_ticks - 1);
+  } else {
+    after_memop[l] = 1;
+  }
+  if (m.dma.len) {
+    m.run_dma();
+    for (u32 i = 0; i < m.dma.stored; i++)
+      wrote(m.dma.stored_at + i);
+  }
+  const u64 held = (words + std::exchange(m.dma.accesses, 0)) * timing_config.memory_latency - 1;
+
+  insn_pointer[l]++;
+  retired[l]++;
+  ticked[l] += ticks + held;
+  stalled[l] += stalls + held;
+  stalled_on[int(timing::Stall::memop) * lanes + l] += stalls;
+  stalled_on[int(timing::Stall::memory) * lanes + l] += held;
+  return ticks + held;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "processor.hpp"
+#include <span>
+#include <vector>
+
+// ===========================================================================
+// Many runs of the same image at once, each on its own input, in lockstep.
+//
+// It is the functional model (see functional.cpp) over a number of lanes, a
+// lane being the state of one processor. State is laid out by register, then
+// by lane, so an insn that many lanes execute together is a loop over lanes,
+// which the host compiler turns into SIMD code.
+//
+// On every step, the lanes at the lowest insn pointer execute the insn there,
+// and the lanes that are ahead wait for them to catch up, as happens when some
+// of them leave a loop sooner than the others. Any lane that has other code at
+// that address, having written over it, goes on by itself. Lanes do not share
+// memory, so memops and DMA are done lane by lane as well.
+//
+// Ticks are estimated the same as by `Processor::next_insn()`, for any timing
+// config without a pipelined mul or div.
+
+struct Lockstep {
+  // A lane per MMIO device
+  Lockstep(std::span<const u32> image, std::span<Mmio* const>, const timing::Config& = {});
+
+  u32 num_lanes() const { return lanes; }
+  void run(u64 max_ticks); // Until every lane has halted or ticked `max_ticks`
+
+  enum class Lane_state: u8 { running, halted, timed_out };
+  std::vector<Lane_state> state;
+  std::vector<u64> ticked;
+  std::vector<u64> stalled;
+  std::vector<u64> stalled_on; // [cause][lane]
+  std::vector<u64> retired;
+
+  std::vector<u32> insn_pointer;
+  std::vector<u8> after_memop; // The memop's second tick is not accounted for yet
+  std::vector<u32> registers; // [regid][lane]
+  std::vector<u32> vectors; // [vector regid][word][lane]
+  std::vector<Processor::Mem> mem;
+
+  u32* reg(u32 regid) { return &registers[regid * lanes]; }
+  u32* vec(u32 regid, u32 word) { return &vectors[(regid * vector_width + word) * lanes]; }
+
+private:
+  u32 lanes;
+  timing::Config timing_config;
+
+  // Until any lane stores to a word of the image, it is the same for all of
+  // them, and the insn there is fetched once instead of lane by lane
+  std::vector<u32> code;
+  std::vector<u8> written;
+  void wrote(u32 addr) {
+    if (addr < written.size())
+      written[addr] = 1;
+  }
+
+  // Lanes executing the current insn, as a mask over all of them, and only
+  // if there are few of them, also as a list
+  std::vector<u8> in_group;
+  u32 group_size;
+  std::vector<u32> group;
+  std::vector<u32> waiting; // At the same address, but not yet sorted by what is there
+  std::vector<u32> fetched;
+  std::vector<u32> scratch1, scratch2; // Immediate operands, one per lane
+  bool wide() const { return group_size * 4 >= lanes; }
+
+  void fill_group();
+  template<typename F> void each(F&& f);
+  template<typename F> void each_scalar(F&& f);
+  // These return: at most how many ticks a lane took
+  u64 step(u32 pc, u32 insn);
+  void alu(Processor::Alu::Op, u32* dest, const u32* src1, const u32* src2);
+  u64 memop(u32 lane, u32 insn);
+};
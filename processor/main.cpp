@@ -1,40 +1,362 @@
+#include "manifest.hpp"
+#include "mmio.hpp"
+#include "multicore.hpp"
 #include "processor.hpp"
+#include "profile.hpp"
+#include "sampling.hpp"
+#include "trace.hpp"
+#include "translator.hpp"
 #include "util.hpp"
-#include <cassert>
-#include <fstream>
-#include <span>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 
-static std::vector<std::byte> get_whole_file(const char* filename) {
-  std::ifstream f(filename, std::ios::binary | std::ios::ate);
-  if (!f)
-    FATAL("Failed to load f '{}'", filename);
-
-  const auto size = f.tellg();
-  f.seekg(0, f.beg);
-
-  std::vector<std::byte> image_mem(size);
-  f.read(reinterpret_cast<char*>(image_mem.data()), size);
-  return image_mem;
+static void usage(const char* argv0) {
+  FATAL("Usage: {} [--fast | --jit] [--trace=none|summary|ticks] [--trace-file=FILE]"
+      " [--trace-from=TICK] [--trace-to=TICK] [--trace-pc=LO-HI]"
+      " [--checkpoint=TICK:FILE] [--io=interactive|buffered] [--input=FILE]"
+      " [--record=FILE | --replay=FILE] [--markers=FILE]"
+      " [--profile=FILE] [--profile-stacks=FILE] [--source-map=FILE]"
+      " [--predictor=none|backward|2bit] [--prefetch=DEPTH] [--sample=INSNS:TICKS]"
+      " [--timing=FILE] [--cores=N] [--quantum=TICKS]"
+      " <image> | --resume=FILE", argv0);
 }
 
 int main(int argc, char** argv) {
-  if (argc != 2)
-    FATAL("Usage: {} <image>", argv[0]);
+  const char* image_filename = nullptr;
+  enum class Mode { pipeline, fast, jit } mode = Mode::pipeline;
+  enum class Trace_level { none, summary, ticks } trace_level = Trace_level::ticks;
+  const char* trace_filename = nullptr;
+  decltype(Processor::trace_filter) trace_filter;
+  const char* resume_filename = nullptr;
+  using Predictor_kind = Processor::Fetch::Predictor::Kind;
+  std::optional<Predictor_kind> predictor; // None given, rather than `none`
+  u32 prefetch_depth = 0;
+  struct { u32 fast_forward = 0; u32 window = 0; } sample;
+  const char* timing_filename = nullptr;
+  u32 num_cores = 1;
+  u32 quantum = 1;
+  struct { u64 tick = 0; const char* filename = nullptr; } checkpoint;
+  // Someone at a terminal wants to see output as it is made, anyone else wants it fast
+  bool interactive = isatty(STDIN_FILENO);
+  const char* input_filename = nullptr;
+  const char* record_filename = nullptr;
+  const char* replay_filename = nullptr;
+  const char* markers_filename = nullptr;
+  struct {
+    const char* report_filename = nullptr;
+    const char* stacks_filename = nullptr;
+    const char* source_map_filename = nullptr;
+  } profile;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    std::string_view value = arg.substr(arg.find('=') + 1);
+    if (arg == "--fast") {
+      mode = Mode::fast;
+    } else if (arg == "--jit") {
+      mode = Mode::jit;
+    } else if (arg.starts_with("--trace=")) {
+      if (value == "none") trace_level = Trace_level::none;
+      else if (value == "summary") trace_level = Trace_level::summary;
+      else if (value == "ticks") trace_level = Trace_level::ticks;
+      else usage(argv[0]);
+    } else if (arg.starts_with("--trace-file=")) {
+      trace_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--trace-from=")) {
+      trace_filter.from_tick = util::parse_number<u64>(value);
+    } else if (arg.starts_with("--trace-to=")) {
+      trace_filter.to_tick = util::parse_number<u64>(value);
+    } else if (arg.starts_with("--trace-pc=")) {
+      const auto dash = value.find('-');
+      if (dash == value.npos)
+        usage(argv[0]);
+      trace_filter.pc_lo = util::parse_number(value.substr(0, dash));
+      trace_filter.pc_hi = util::parse_number(value.substr(dash + 1));
+    } else if (arg.starts_with("--checkpoint=")) {
+      const auto colon = value.find(':');
+      if (colon == value.npos)
+        usage(argv[0]);
+      checkpoint.tick = util::parse_number<u64>(value.substr(0, colon));
+      checkpoint.filename = argv[i] + (arg.size() - value.size()) + colon + 1;
+    } else if (arg.starts_with("--io=")) {
+      if (value == "interactive") interactive = true;
+      else if (value == "buffered") interactive = false;
+      else usage(argv[0]);
+    } else if (arg.starts_with("--input=")) {
+      input_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--record=")) {
+      record_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--replay=")) {
+      replay_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--markers=")) {
+      markers_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--profile=")) {
+      profile.report_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--profile-stacks=")) {
+      profile.stacks_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--source-map=")) {
+      profile.source_map_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--predictor=")) {
+      if (value == "none") predictor = Predictor_kind::none;
+      else if (value == "backward") predictor = Predictor_kind::backward_taken;
+      else if (value == "2bit") predictor = Predictor_kind::two_bit;
+      else usage(argv[0]);
+    } else if (arg.starts_with("--prefetch=")) {
+      prefetch_depth = util::parse_number(value);
+      if (prefetch_depth == 0 || prefetch_depth > Processor::Fetch::max_queue_depth)
+        FATAL("Prefetch depth should be 1 to {}", Processor::Fetch::max_queue_depth);
+    } else if (arg.starts_with("--sample=")) {
+      const auto colon = value.find(':');
+      if (colon == value.npos)
+        usage(argv[0]);
+      sample.fast_forward = util::parse_number(value.substr(0, colon));
+      sample.window = util::parse_number(value.substr(colon + 1));
+      if (sample.window == 0)
+        usage(argv[0]);
+    } else if (arg.starts_with("--timing=")) {
+      timing_filename = argv[i] + arg.find('=') + 1;
+    } else if (arg.starts_with("--cores=")) {
+      num_cores = util::parse_number(value);
+      if (num_cores == 0)
+        usage(argv[0]);
+    } else if (arg.starts_with("--quantum=")) {
+      quantum = util::parse_number(value);
+      if (quantum == 0)
+        usage(argv[0]);
+    } else if (arg.starts_with("--resume=")) {
+      resume_filename = argv[i] + arg.find('=') + 1;
+    } else if (!arg.starts_with("--") && !image_filename) {
+      image_filename = argv[i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+  // A snapshot has the memory in it, so it replaces the image
+  if (!image_filename == !resume_filename)
+    usage(argv[0]);
+  // ... and it is of the pipeline, which the other modes do not simulate
+  const bool profiling = profile.report_filename || profile.stacks_filename;
+  const bool predicting = predictor.value_or(Predictor_kind::none) != Predictor_kind::none;
+  if (mode != Mode::pipeline
+  && (resume_filename || checkpoint.filename || profiling || predicting || prefetch_depth))
+    usage(argv[0]);
+  if (interactive && input_filename)
+    usage(argv[0]);
+  // A recording has the input in it
+  if (replay_filename && (record_filename || input_filename))
+    usage(argv[0]);
+  // Sampling switches modes by itself, from the start of the program
+  const bool sampling = sample.window != 0;
+  if (sampling && (mode != Mode::pipeline || resume_filename || checkpoint.filename || profiling))
+    usage(argv[0]);
+  // Several cores only ever run from the start to the end, with no log of their ticks
+  const bool multicore = num_cores > 1;
+  if (multicore && (mode != Mode::pipeline || sampling || resume_filename || checkpoint.filename
+  || profiling || trace_filename || record_filename || replay_filename || markers_filename))
+    usage(argv[0]);
+
+  std::vector<u32> image;
+  if (image_filename)
+    image = read_image(image_filename);
+
+  std::unique_ptr<Buffered_mmio> buffered_io;
+  if (!interactive)
+    buffered_io = std::make_unique<Buffered_mmio>(input_filename);
+  Mmio& device_io = buffered_io ? *buffered_io : console_mmio();
+
+  // Either of these sits between the program and what it would have talked to
+  std::unique_ptr<Recording_mmio> recording_io;
+  std::unique_ptr<Replaying_mmio> replaying_io;
+  if (record_filename)
+    recording_io = std::make_unique<Recording_mmio>(device_io, record_filename);
+  if (replay_filename)
+    replaying_io = std::make_unique<Replaying_mmio>(replay_filename, device_io);
+  Mmio& io = recording_io ? static_cast<Mmio&>(*recording_io)
+    : replaying_io ? static_cast<Mmio&>(*replaying_io)
+    : device_io;
+  // Where the program's markers go, as '<tick> <label>' lines (see isa.hpp)
+  std::FILE* markers = nullptr;
+  if (markers_filename && !(markers = std::fopen(markers_filename, "w")))
+    FATAL("Failed to open '{}' for writing", markers_filename);
+  const auto done_with_io = [&] {
+    if (buffered_io)
+      buffered_io->flush();
+    if (replaying_io)
+      replaying_io->finish();
+    if (markers)
+      std::fclose(markers);
+  };
+
+  if (multicore) {
+    Multicore machine(image, io, num_cores);
+    machine.quantum = quantum;
+    for (auto& core: machine.cores) {
+      if (timing_filename)
+        core->set_timing_config(timing::Config::load(timing_filename));
+      core->fetch.predictor.kind = predictor.value_or(Predictor_kind::none);
+      core->fetch.queue_depth = prefetch_depth;
+    }
+    machine.run();
+    done_with_io();
+    if (trace_level != Trace_level::none)
+      machine.write_report(stderr);
+    return 0;
+  }
+
+  Processor proc(image, io);
+  proc.mem.counters.markers = markers;
+  if (recording_io)
+    recording_io->clock = &proc.stats.ticked;
+  if (replaying_io)
+    replaying_io->clock = &proc.stats.ticked;
+  if (timing_filename)
+    proc.set_timing_config(timing::Config::load(timing_filename));
+  // Caches are only there for the pipeline, the other models do not fetch
+  if (proc.timing_config.has_caches() && (mode != Mode::pipeline || sampling))
+    FATAL("Caches are only modelled by the pipeline, and without sampling");
+  if (resume_filename) {
+    // The snapshot comes with its own fetch queue, which may have insns in it
+    proc.load_snapshot(resume_filename);
+    if (prefetch_depth && prefetch_depth != proc.fetch.queue_depth)
+      FATAL("Snapshot '{}' was taken with a prefetch depth of {}", resume_filename, proc.fetch.queue_depth);
+    // ... and its predictor, which has learned what it has by then
+    if (predictor && *predictor != proc.fetch.predictor.kind)
+      FATAL("Snapshot '{}' was taken with another branch predictor", resume_filename);
+  } else {
+    proc.fetch.queue_depth = prefetch_depth;
+    proc.fetch.predictor.kind = predictor.value_or(Predictor_kind::none);
+  }
+  proc.trace_filter = trace_filter;
+
+  // Only asked for along with a timing config, which is what makes it interesting
+  const auto log_stall_breakdown = [&] {
+    if (!timing_filename)
+      return;
+    const auto stalled_on = [&] (timing::Stall cause) { return proc.stats.stalled_on[int(cause)]; };
+    LOG("Stalled on jumps: {}, memops: {}, fetch: {}, memory: {}, mul/div: {}",
+        stalled_on(timing::Stall::jump), stalled_on(timing::Stall::memop),
+        stalled_on(timing::Stall::fetch), stalled_on(timing::Stall::memory),
+        stalled_on(timing::Stall::muldiv));
+    for (const auto& [name, cache]: { std::pair{"I-cache", &proc.mem.icache}, {"D-cache", &proc.mem.dcache} }) {
+      if (!cache->enabled())
+        continue;
+      const u64 accesses = cache->stats.hits + cache->stats.misses;
+      LOG("{}: hits: {}, misses: {} ({:.1f}% hit), stalled on misses: {}",
+          name, cache->stats.hits, cache->stats.misses,
+          100.0 * double(cache->stats.hits) / double(std::max<u64>(accesses, 1)),
+          cache->stats.miss_ticks);
+    }
+  };
+
+  if (sampling) {
+    Sampler sampler;
+    sampler.fast_forward = sample.fast_forward;
+    sampler.window = sample.window;
+    sampler.run(proc);
+    done_with_io();
+    if (trace_level != Trace_level::none)
+      sampler.write_report(stderr);
+    return 0;
+  }
+
+  switch (mode) {
+  case Mode::pipeline:
+    break;
+  case Mode::fast:
+  case Mode::jit:
+    // Only the program's output and a cycle estimate, no per-tick log
+    if (mode == Mode::fast) {
+      while (proc.next_insn())
+        ;
+    } else {
+      Translator(proc).run();
+    }
+    done_with_io();
+    if (trace_level != Trace_level::none) {
+      LOG("Ticked (estimate): {}, stalled: {}", proc.stats.ticked, proc.stats.stalled);
+      log_stall_breakdown();
+    }
+    return 0;
+  }
+
+  // A binary trace is much cheaper to write than text, `trace-render` turns it into text
+  std::unique_ptr<Trace_writer> trace;
+  if (trace_filename) {
+    trace = std::make_unique<Trace_writer>(trace_filename);
+    proc.trace_file = trace.get();
+  }
 
-  const char* image_filename = argv[1];
-  auto image_bytes = get_whole_file(image_filename);
-  assert(image_bytes.size() % sizeof(u32) == 0);
+  std::unique_ptr<Profiler> profiler;
+  if (profiling)
+    profiler = std::make_unique<Profiler>();
 
-  auto image_u32s = std::span{
-    reinterpret_cast<const u32*>(image_bytes.data()),
-    image_bytes.size() / sizeof(u32)
+  // returns: whether still running
+  const auto run_until = [&] (u64 tick) {
+    const auto loop = [&] (auto next_tick) {
+      bool running = true;
+      while (proc.stats.ticked < tick && (running = next_tick()))
+        ;
+      return running;
+    };
+    const bool traced = trace_level == Trace_level::ticks;
+    if (profiler) {
+      return loop([&] {
+        const bool running = traced ? proc.next_tick<true>() : proc.next_tick<false>();
+        if (running)
+          profiler->after_tick(proc);
+        return running;
+      });
+    }
+    if (traced)
+      return loop([&] { return proc.next_tick<true>(tick - proc.stats.ticked); });
+    return loop([&] { return proc.next_tick<false>(tick - proc.stats.ticked); });
   };
 
-  Processor proc(image_u32s);
+  bool running = true;
+  if (checkpoint.filename) {
+    running = run_until(checkpoint.tick);
+    if (running)
+      proc.save_snapshot(checkpoint.filename);
+    else
+      LOG("Halted before tick {}, no checkpoint taken", checkpoint.tick);
+  }
+  if (running)
+    run_until(std::numeric_limits<u64>::max()); // Which is never reached, so until it halts
 
-  while (proc.next_tick())
-    ;
+  done_with_io();
+  if (trace_level != Trace_level::none) {
+    print_trace_summary(stderr, proc.stats.ticked, proc.stats.stalled);
+    log_stall_breakdown();
+    if (proc.fetch.predictor.kind != Predictor_kind::none) {
+      const int right = proc.stats.branches - proc.stats.mispredicted;
+      LOG("Branches: {}, mispredicted: {} ({:.1f}% predicted right)",
+          proc.stats.branches, proc.stats.mispredicted,
+          100.0 * right / std::max(proc.stats.branches, 1));
+    }
+  }
+  if (trace)
+    trace->write_summary(proc.stats.ticked, proc.stats.stalled);
 
-  LOG("Ticked: {}, stalled: {}", proc.stats.ticked, proc.stats.stalled);
+  if (profiler) {
+    std::unique_ptr<Source_map> map;
+    if (profile.source_map_filename)
+      map = std::make_unique<Source_map>(profile.source_map_filename);
+    const auto write = [&] (const char* filename, auto what) {
+      if (!filename)
+        return;
+      std::FILE* out = std::fopen(filename, "w");
+      if (!out)
+        FATAL("Cannot open '{}'", filename);
+      (profiler.get()->*what)(out, map.get());
+      std::fclose(out);
+    };
+    write(profile.report_filename, &Profiler::write_report);
+    write(profile.stacks_filename, &Profiler::write_collapsed_stacks);
+  }
 }
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "manifest.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+std::string read_whole_file(const std::filesystem::path& path) {
+  std::ifstream f(path, std::ios::binary);
+  if (!f)
+    FATAL("Failed to load file '{}'", path.string());
+  std::ostringstream ss;
+  ss << f.rdbuf();
+  return std::move(ss).str();
+}
+
+std::vector<u32> read_image(const std::filesystem::path& path) {
+  const std::string bytes = read_whole_file(path);
+  if (bytes.size() % sizeof(u32) != 0)
+    FATAL("Image '{}' is not a whole number of words", path.string());
+  std::vector<u32> image(bytes.size() / sizeof(u32));
+  std::copy(bytes.begin(), bytes.end(), reinterpret_cast<char*>(image.data()));
+  return image;
+}
+
+
+Manifest::Manifest(const char* manifest_filename)
+: filename(manifest_filename), base(std::filesystem::path(manifest_filename).parent_path()) {
+  std::istringstream in(read_whole_file(manifest_filename));
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); line_number++) {
+    std::istringstream fields(line);
+    Entry entry = { line_number, {} };
+    for (std::string field; fields >> field; )
+      entry.fields.push_back(std::move(field));
+    if (entry.fields.empty() || entry.fields.front().starts_with('#'))
+      continue;
+    entries.push_back(std::move(entry));
+  }
+}
+
+std::filesystem::path Manifest::path(const std::string& field) const {
+  return base / field;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "processor.hpp"
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// ===========================================================================
+// Manifests, which list programs to run, and the files they point at.
+//
+// A manifest is a text file with an entry per line, as whitespace separated
+// fields. What the fields are is up to whoever reads it, see processor-batch
+// and bench-processor. Paths in it are relative to the manifest. Empty lines
+// and lines starting with '#' are ignored.
+
+std::string read_whole_file(const std::filesystem::path&);
+std::vector<u32> read_image(const std::filesystem::path&); // Fails unless it is whole words
+
+struct Manifest {
+  explicit Manifest(const char* filename);
+
+  struct Entry {
+    int line_number;
+    std::vector<std::string> fields;
+  };
+  std::string filename;
+  std::vector<Entry> entries;
+
+  std::filesystem::path path(const std::string& field) const; // As the manifest means it
+
+private:
+  std::filesystem::path base;
+};
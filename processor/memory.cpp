@@ -0,0 +1,45 @@
+#include "memory.hpp"
+
+namespace {
+
+constexpr uint32_t no_page = ~0u; // Page numbers only take 20 bits
+
+} // anon namespace
+
+Paged_memory::Paged_memory() {
+  clear();
+}
+
+Paged_memory::~Paged_memory() = default;
+
+void Paged_memory::clear() {
+  for (auto& table: directory)
+    table.reset();
+  cache.fill({ .page_number = no_page, .words = nullptr });
+  allocated = 0;
+}
+
+uint32_t* Paged_memory::find_page_slow(uint32_t page_number) {
+  const auto& table = directory[page_number >> table_bits];
+  if (!table)
+    return nullptr;
+  const auto& page = (*table)[page_number & (table_size - 1)];
+  if (!page)
+    return nullptr;
+
+  cache[page_number % cache_size] = { .page_number = page_number, .words = page->data() };
+  return page->data();
+}
+
+uint32_t* Paged_memory::allocate_page(uint32_t page_number) {
+  auto& table = directory[page_number >> table_bits];
+  if (!table)
+    table = std::make_unique<Table>();
+  auto& page = (*table)[page_number & (table_size - 1)];
+  page = std::make_unique_for_overwrite<Page>();
+  page->fill(unwritten);
+  allocated++;
+
+  cache[page_number % cache_size] = { .page_number = page_number, .words = page->data() };
+  return page->data();
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// ===========================================================================
+// Sparse memory over the whole 32-bit (word) address space.
+//
+// Memory is split into pages, which only get allocated once something is
+// stored there. Words never stored to read as `unwritten`, which is also what
+// the memory outside the image used to read as, back when that was all there
+// was to it. Pages are found through a two-level table, and the most recently
+// used ones are remembered in a small direct-mapped cache in front of it.
+
+struct Paged_memory {
+  static constexpr uint32_t page_bits = 12;
+  static constexpr uint32_t page_words = 1u << page_bits;
+  static constexpr uint32_t unwritten = 0xBADF00D;
+
+  Paged_memory();
+  ~Paged_memory();
+  Paged_memory(const Paged_memory&) = delete;
+  Paged_memory& operator=(const Paged_memory&) = delete;
+
+  uint32_t load(uint32_t addr) {
+    if (const uint32_t* page = find_page(addr >> page_bits))
+      return page[addr & (page_words - 1)];
+    return unwritten;
+  }
+  void store(uint32_t addr, uint32_t value) {
+    page_for_store(addr >> page_bits)[addr & (page_words - 1)] = value;
+  }
+
+  uint32_t* find_page(uint32_t page_number) { // returns: nullptr if there is no such page
+    const Cached_page& cached = cache[page_number % cache_size];
+    if (cached.page_number == page_number)
+      return cached.words;
+    return find_page_slow(page_number);
+  }
+  uint32_t* page_for_store(uint32_t page_number) {
+    if (uint32_t* page = find_page(page_number))
+      return page;
+    return allocate_page(page_number);
+  }
+
+  size_t num_pages() const { return allocated; }
+  void clear();
+
+  // Calls `f(page_number, const uint32_t* words)` for every allocated page
+  template<typename F> void for_each_page(F&& f) const {
+    for (uint32_t dir = 0; dir < directory.size(); dir++) {
+      if (!directory[dir])
+        continue;
+      for (uint32_t i = 0; i < table_size; i++) {
+        if (const auto& page = (*directory[dir])[i])
+          f(dir << table_bits | i, page->data());
+      }
+    }
+  }
+
+  // Only allocated pages ever get here. Laid out the way translated code expects it
+  struct Cached_page {
+    uint32_t page_number;
+    uint32_t* words;
+  };
+  static constexpr uint32_t cache_size = 64;
+  std::array<Cached_page, cache_size> cache;
+
+private:
+  static constexpr uint32_t table_bits = 10;
+  static constexpr uint32_t table_size = 1u << table_bits;
+
+  using Page = std::array<uint32_t, page_words>;
+  using Table = std::array<std::unique_ptr<Page>, table_size>;
+  std::array<std::unique_ptr<Table>, 1u << (32 - page_bits - table_bits)> directory;
+  size_t allocated = 0;
+
+  uint32_t* find_page_slow(uint32_t page_number);
+  uint32_t* allocate_page(uint32_t page_number);
+};
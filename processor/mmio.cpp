@@ -0,0 +1,224 @@
+#include "mmio.hpp"
+#include "util.hpp"
+#include <charconv>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+u32 Console_mmio::get() {
+  int c = std::cin.get();
+  if (c == -1)
+    return 0;
+  return u32(c);
+}
+
+void Console_mmio::push(u32 c) {
+  std::cout << char(c) << std::flush;
+}
+
+Mmio& console_mmio() {
+  static Console_mmio console;
+  return console;
+}
+
+
+Buffered_mmio::Buffered_mmio(const char* input_filename) {
+  const int fd = input_filename ? open(input_filename, O_RDONLY) : STDIN_FILENO;
+  if (fd < 0)
+    FATAL("Cannot open input file '{}'", input_filename);
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    // Regular files map fine, but stdin may have been read from already
+    const off_t start = input_filename ? 0 : lseek(fd, 0, SEEK_CUR);
+    mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED)
+      mapped = nullptr;
+    else
+      mapped_size = st.st_size;
+    if (mapped && start >= 0 && start <= st.st_size) {
+      input = static_cast<const char*>(mapped) + start;
+      input_size = st.st_size - start;
+    }
+  }
+  if (mapped) {
+    if (input_filename)
+      close(fd);
+  } else {
+    // A pipe or some such, has to be read as it goes
+    input_fd = fd;
+    input_chunk.resize(1 << 16);
+  }
+
+  output.reserve(output_capacity);
+}
+
+Buffered_mmio::~Buffered_mmio() {
+  flush();
+  if (mapped)
+    munmap(mapped, mapped_size);
+  if (input_fd >= 0 && input_fd != STDIN_FILENO)
+    close(input_fd);
+}
+
+u32 Buffered_mmio::get() {
+  if (input_pos == input_size)
+    return get_slow();
+  return u8(input[input_pos++]);
+}
+
+u32 Buffered_mmio::get_slow() {
+  if (input_fd < 0)
+    return 0;
+  const ssize_t got = read(input_fd, input_chunk.data(), input_chunk.size());
+  if (got <= 0) {
+    input_fd = -1; // Either over or broken, and the program cannot tell those apart anyway
+    return 0;
+  }
+  input = input_chunk.data();
+  input_size = got;
+  input_pos = 1;
+  return u8(input[0]);
+}
+
+void Buffered_mmio::push(u32 c) {
+  output.push_back(char(c));
+  if (output.size() == output_capacity)
+    flush();
+}
+
+void Buffered_mmio::flush() {
+  if (!output.empty()) {
+    std::fwrite(output.data(), 1, output.size(), stdout);
+    std::fflush(stdout);
+  }
+  output.clear();
+}
+
+
+u32 Buffer_mmio::get() {
+  if (input_pos == input.size())
+    return 0;
+  return u8(input[input_pos++]);
+}
+
+void Buffer_mmio::push(u32 c) {
+  output.push_back(char(c));
+}
+
+
+auto Mmio_log::load(const char* filename) -> Mmio_log {
+  std::ifstream in(filename);
+  if (!in)
+    FATAL("Cannot open MMIO recording '{}'", filename);
+
+  Mmio_log log;
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); line_number++) {
+    std::istringstream fields(line);
+    std::string tick, what, extra;
+    u32 value;
+    if (!(fields >> tick) || tick.starts_with('#'))
+      continue;
+    u64 at;
+    auto [end, ec] = std::from_chars(tick.data(), tick.data() + tick.size(), at);
+    if (ec != std::errc{} || end != tick.data() + tick.size()
+    || !(fields >> what >> value) || (fields >> extra) || (what != "get" && what != "push"))
+      FATAL("{}:{}: Expected '<tick> get|push <value>'", filename, line_number);
+    log.events.push_back({ .tick = at, .push = what == "push", .value = value });
+  }
+  return log;
+}
+
+std::string Mmio_log::input() const {
+  std::string result;
+  for (const Event& event: events) {
+    if (!event.push)
+      result.push_back(char(event.value));
+  }
+  return result;
+}
+
+std::string Mmio_log::output() const {
+  std::string result;
+  for (const Event& event: events) {
+    if (event.push)
+      result.push_back(char(event.value));
+  }
+  return result;
+}
+
+
+Recording_mmio::Recording_mmio(Mmio& inner_mmio, const char* log_filename)
+: inner(inner_mmio), log(std::fopen(log_filename, "w")) {
+  if (!log)
+    FATAL("Cannot open '{}' to record MMIO to", log_filename);
+  fmt::print(log, FMT_STRING("# tick get|push value\n"));
+}
+
+Recording_mmio::~Recording_mmio() {
+  std::fclose(log);
+}
+
+u32 Recording_mmio::get() {
+  const u32 value = inner.get();
+  fmt::print(log, FMT_STRING("{} get {}\n"), clock ? *clock : 0, value);
+  return value;
+}
+
+void Recording_mmio::push(u32 value) {
+  fmt::print(log, FMT_STRING("{} push {}\n"), clock ? *clock : 0, value);
+  inner.push(value);
+}
+
+
+Replaying_mmio::Replaying_mmio(const char* log_filename, Mmio& output_mmio)
+: log(Mmio_log::load(log_filename)), output(output_mmio) {}
+
+u32 Replaying_mmio::get() {
+  if (pos == log.events.size()) {
+    output.flush();
+    FATAL("Replay diverged at tick {}: got input, but the recording is over", now());
+  }
+  const Mmio_log::Event& event = log.events[pos];
+  if (event.push) {
+    output.flush();
+    FATAL("Replay diverged at tick {}: got input, but the recording pushed {} at tick {}",
+        now(), event.value, event.tick);
+  }
+  pos++;
+  return event.value;
+}
+
+void Replaying_mmio::push(u32 value) {
+  if (pos == log.events.size()) {
+    output.flush();
+    FATAL("Replay diverged at tick {}: pushed {}, but the recording is over", now(), value);
+  }
+  const Mmio_log::Event& event = log.events[pos];
+  if (!event.push) {
+    output.flush();
+    FATAL("Replay diverged at tick {}: pushed {}, but the recording got input at tick {}",
+        now(), value, event.tick);
+  }
+  if (event.value != value) {
+    output.flush();
+    FATAL("Replay diverged at tick {}: pushed {}, but the recording pushed {} at tick {}",
+        now(), value, event.value, event.tick);
+  }
+  pos++;
+  output.push(value);
+}
+
+void Replaying_mmio::finish() {
+  if (pos != log.events.size()) {
+    output.flush();
+    FATAL("Replay is over at tick {}, but the recording goes on to tick {}",
+        now(), log.events.back().tick);
+  }
+}
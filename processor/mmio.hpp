@@ -0,0 +1,121 @@
+#pragma once
+#include "processor.hpp"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// ===========================================================================
+// What sits behind the MMIO port. The processor only ever loads or stores
+// a single word there, which is a character of input or output.
+
+struct Mmio {
+  virtual ~Mmio() = default;
+  virtual u32 get() = 0; // returns: 0 once input is over
+  virtual void push(u32) = 0;
+  virtual void flush() {} // Of output held back, if any, for whoever is about to fail
+};
+
+// stdin and stdout, every character goes through as soon as it is stored
+struct Console_mmio final: Mmio {
+  u32 get() override;
+  void push(u32) override;
+};
+
+Mmio& console_mmio();
+
+// Input straight from a file mapped into memory (or, if stdin is not a file,
+// read in large chunks as needed), output collected and written out in large chunks
+// when the buffer fills up or the program is done. Not suitable for talking
+// to a human, but spares a syscall or two per character
+struct Buffered_mmio final: Mmio {
+  explicit Buffered_mmio(const char* input_filename); // nullptr for stdin
+  ~Buffered_mmio() override;
+  Buffered_mmio(const Buffered_mmio&) = delete;
+  Buffered_mmio& operator=(const Buffered_mmio&) = delete;
+
+  u32 get() override;
+  void push(u32) override;
+  void flush() override;
+
+private:
+  static constexpr size_t output_capacity = 1 << 16;
+
+  const char* input = nullptr;
+  size_t input_size = 0;
+  size_t input_pos = 0;
+  void* mapped = nullptr;
+  size_t mapped_size = 0;
+  int input_fd = -1; // When the input could not be mapped
+  std::string input_chunk;
+
+  u32 get_slow();
+
+  std::string output;
+};
+
+// All of input is known upfront, output is collected for whoever is interested
+struct Buffer_mmio final: Mmio {
+  explicit Buffer_mmio(std::string in): input(std::move(in)) {}
+
+  std::string input;
+  size_t input_pos = 0;
+  std::string output;
+
+  u32 get() override;
+  void push(u32) override;
+};
+
+// What went through the MMIO port in a run, in order, as written down by
+// `Recording_mmio`. The file has a line per word, '<tick> get <value>' or
+// '<tick> push <value>', and lines starting with '#' are ignored
+struct Mmio_log {
+  struct Event {
+    u64 tick; // As the model that ran it counted them, only to tell where things went
+    bool push;
+    u32 value;
+  };
+  std::vector<Event> events;
+
+  static Mmio_log load(const char* filename);
+  std::string input() const; // Every word got, in order
+  std::string output() const; // ... and pushed
+};
+
+// Passes everything on to another MMIO, and writes down what went by
+struct Recording_mmio final: Mmio {
+  Recording_mmio(Mmio& inner, const char* log_filename);
+  ~Recording_mmio() override;
+  Recording_mmio(const Recording_mmio&) = delete;
+  Recording_mmio& operator=(const Recording_mmio&) = delete;
+
+  const u64* clock = nullptr; // What tick it is, if anyone says
+
+  u32 get() override;
+  void push(u32) override;
+  void flush() override { inner.flush(); }
+
+private:
+  Mmio& inner;
+  std::FILE* log;
+};
+
+// Input played back from a recording, and output checked against it as it is
+// pushed, failing at the first word that is not the same. Output goes on to
+// another MMIO as well, so the run looks as it did, up to where it failed
+struct Replaying_mmio final: Mmio {
+  Replaying_mmio(const char* log_filename, Mmio& output);
+
+  const u64* clock = nullptr;
+
+  u32 get() override;
+  void push(u32) override;
+  void flush() override { output.flush(); }
+  void finish(); // Fails unless all of the recording got played back
+
+private:
+  Mmio_log log;
+  size_t pos = 0;
+  Mmio& output;
+
+  u64 now() const { return clock ? *clock : 0; }
+};
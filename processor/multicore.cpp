@@ -0,0 +1,42 @@
+#include "multicore.hpp"
+#include "util.hpp"
+#include <algorithm>
+
+Multicore::Multicore(std::span<const u32> image, Mmio& mmio, u32 num_cores) {
+  const auto memory = Processor::load_image(image);
+  for (u32 id = 0; id < num_cores; id++)
+    cores.push_back(std::make_unique<Processor>(memory, mmio, id, num_cores));
+}
+
+void Multicore::run() {
+  std::vector<Processor*> running;
+  for (auto& core: cores)
+    running.push_back(core.get());
+
+  while (!running.empty()) {
+    // A halted core drops out, and the rest go on in the same order
+    std::erase_if(running, [&] (Processor* core) {
+      const u64 until = core->stats.ticked + quantum;
+      while (core->stats.ticked < until) {
+        if (!core->next_tick<false>(until - core->stats.ticked))
+          return true;
+      }
+      return false;
+    });
+  }
+}
+
+u64 Multicore::ticked() const {
+  u64 result = 0;
+  for (const auto& core: cores)
+    result = std::max(result, core->stats.ticked);
+  return result;
+}
+
+void Multicore::write_report(std::FILE* out) const {
+  for (size_t id = 0; id < cores.size(); id++) {
+    fmt::print(out, FMT_STRING("Core {} ticked: {}, stalled: {}\n"),
+        id, cores[id]->stats.ticked, cores[id]->stats.stalled);
+  }
+  fmt::print(out, FMT_STRING("Ticked: {}\n"), ticked());
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "processor.hpp"
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <vector>
+
+// ===========================================================================
+// Several cores on one memory.
+//
+// Every core is a whole pipeline of its own, with its own registers and
+// caches, running the same image from address 0. What they share is memory
+// and the MMIO port, and a program tells them apart by reading `core_id_addr`
+// (see isa.hpp). They talk through memory, and `xadd` is what makes that safe.
+//
+// Cores are stepped one after another, `quantum` ticks at a time, so the same
+// program always interleaves the same way. With a quantum of 1 they are in
+// lockstep, which is the closest to real hardware, and larger ones are cheaper
+// to simulate but let a core run ahead of the others.
+//
+// A core keeps decoded insns around, but each one is checked against the word
+// in memory when it is fetched again, so a store to code by any core, or by
+// DMA, is seen the next time it gets there. Insns already fetched go on as
+// they were, as they would on hardware.
+
+struct Multicore {
+  std::vector<std::unique_ptr<Processor>> cores;
+  u32 quantum = 1;
+
+  Multicore(std::span<const u32> image, Mmio&, u32 num_cores);
+
+  void run(); // Until every core has halted
+
+  // How long the whole machine ran is how long its slowest core did
+  u64 ticked() const;
+  void write_report(std::FILE*) const; // Every core's own summary, then that
+};
@@ -1,127 +1,141 @@
+#include "isa.hpp"
+#include "mmio.hpp"
 #include "processor.hpp"
+#include "trace.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <cassert>
-#include <iostream>
-
-namespace {
-
-// MMIO inside memory manager is magic
-
-constexpr u32 mmio_addr = 0x3;
-
-void mmio_push(u32 c) {
-  std::cout << char(c) << std::flush;
+#include <iterator>
+#include <utility>
+
+// "add r0, r0, 0", which changes nothing even with the pipeline primed mid-program
+constexpr u32 encoded_nop = 0x3 | (1u << 10);
+
+Processor::Processor(std::span<const u32> image, Mmio& mmio)
+: Processor(load_image(image), mmio) {}
+
+Processor::Processor(std::shared_ptr<Paged_memory> memory, Mmio& mmio, u32 core_id, u32 num_cores) {
+  mem.memory = std::move(memory);
+  mem.mmio = &mmio;
+  mem.core_id = core_id;
+  mem.num_cores = num_cores;
+  mem.counters.ticked = &stats.ticked;
+  mem.counters.stalled = &stats.stalled;
+  mem.counters.retired = &stats.retired;
+  prime_pipeline(0);
 }
 
-u32 mmio_get() {
-  int c = std::cin.get();
-  if (c == -1)
-    return 0;
-  return u32(c);
+std::shared_ptr<Paged_memory> Processor::load_image(std::span<const u32> image) {
+  // The rest of memory is there too, but reads as garbage until stored to
+  auto memory = std::make_shared<Paged_memory>();
+  for (u32 addr = 0; addr < image.size(); addr++)
+    memory->store(addr, image[addr]);
+  return memory;
 }
 
-
-enum class Opcode {
-  halt = 0x0,
-  load = 0x1,
-  store = 0x2,
-  add = 0x3,
-  sub = 0x4,
-  mul = 0x5,
-  div = 0x6,
-  mod = 0x7,
-  cmp_equ = 0x8,
-  cmp_gt = 0x9,
-  cmp_lt = 0xA,
-  jmp = 0xB,
-  jif = 0xC,
-};
-
-Processor::Alu::Op binop_to_alu(Opcode opcode) {
-  switch (static_cast<Opcode>(opcode)) {
-  case Opcode::add: return Processor::Alu::Op::add;
-  case Opcode::sub: return Processor::Alu::Op::sub;
-  case Opcode::mul: return Processor::Alu::Op::mul;
-  case Opcode::div: return Processor::Alu::Op::div;
-  case Opcode::mod: return Processor::Alu::Op::mod;
-  case Opcode::cmp_equ: return Processor::Alu::Op::equ;
-  case Opcode::cmp_lt: return Processor::Alu::Op::lt;
-  case Opcode::cmp_gt: return Processor::Alu::Op::gt;
-  default: return {}; // don't care
-  }
+void Processor::set_timing_config(const timing::Config& config) {
+  timing_config = config;
+  mem.icache.configure(config.icache);
+  mem.dcache.configure(config.dcache);
 }
 
-} // anon namespace
-
-
-Processor::Processor(std::span<const u32> image) {
-  // Load memory image.
-  // Doing it this way means that memory outside the image is not
-  // really memory: it will ignore stores and loads will return a
-  // constant value. But programs should never access that anyway
-  // (hardware will, though)
-  mem.memory.assign(image.begin(), image.end());
-
-  { // Fiddle with processor state into beginning execution correctly
-    fetch.addr = -1; // Will get incremented to 0 before fetching
+void Processor::prime_pipeline(u32 insn_pointer) {
+  // Fiddle with processor state into beginning execution correctly
+  fetch.addr = insn_pointer - 1; // Will get incremented before fetching
+  fetch.fetched_from = no_insn_pointer;
+  fetch.fetched_predicted = false;
+  fetch.queue_size = 0;
+
+  // Prime the pipeline with a nop
+  fetch.fetched_insn = encoded_nop;
+  fetch.fetched_valid = true;
+  decoder_in = encoded_nop;
+  mem.rdata = encoded_nop;
+  next_ctrl = {};
+  next_ctrl.insn_addr = no_insn_pointer; // Not a real one
+  ctrl = next_ctrl;
+  hold = {};
+}
 
-    // Prime the pipeline with "add r0, 0, 0".
-    // Not strictly a nop, but it is in this context
-    constexpr u32 encoded_nop = 0x3;
-    fetch.fetched_insn = encoded_nop;
-    decoder_in = encoded_nop;
-    mem.rdata = encoded_nop;
-  }
+u32 Processor::next_insn_pointer() const {
+  // Decoded, not squashed, and about to execute
+  const bool real = next_ctrl.stall == 0 || (next_ctrl.doing_jmp && next_ctrl.stall == timing::jmp_stall);
+  return real ? next_ctrl.insn_addr : no_insn_pointer;
 }
 
 // ===========================================================================
 // Simulating the processor
 
 void Processor::print_state() {
-  LOG("After tick {}: ", stats.ticked);
-
-  LOG("  Mem: addr={:#x}, wdata={:#x}, rdata={:#x}", mem.addr, mem.wdata, mem.rdata);
-
-  {
-    int num_nonzero = 0;
-    LOG_NOLN("  Reg:");
-    for (int i = 0; i < 64; i++) {
-      if (reg.registers[i] != 0) {
-        LOG_NOLN(" r{}={:#x};", i, reg.registers[i]);
-        num_nonzero++;
-      }
-    }
-    if (num_nonzero != 64)
-      LOG_NOLN(" ({} 0)", num_nonzero == 0 ? "all" : "others");
-    LOG("");
-  }
-
-  LOG("  Fetch head={:#x} insn={:#x}", fetch.addr, fetch.fetched_insn);
+  trace_record().print(stderr);
+}
 
-  LOG_NOLN("  Control:");
-  if (ctrl.halt) LOG_NOLN(" +HALT");
-  if (ctrl.stall) LOG_NOLN(" +STALL:{}", int(ctrl.stall));
-  if (ctrl.mem_write) LOG_NOLN(" +mem-write");
-  if (ctrl.mem_read) LOG_NOLN(" +mem-read");
-  if (ctrl.dest_reg_write) LOG_NOLN(" +dest-write");
-  LOG_NOLN(
-    " src1={} src2={} dest={}",
-    ctrl.sel_src1_regid,
-    ctrl.sel_src2_regid,
-    ctrl.sel_dest_regid
-  );
-  if (ctrl.doing_jif) LOG_NOLN(" +jif");
-  if (ctrl.stall_fetched_insn_mux) LOG_NOLN(" +fetch-stall");
-  LOG(" imm1={:#x} imm2={:#x}", ctrl.imm1, ctrl.imm2);
-  LOG("  Decode in={:#x}", decoder_in);
+Trace_record Processor::trace_record() const {
+  Trace_record r = {
+    .tick = stats.ticked,
+    .mem_addr = mem.addr,
+    .mem_wdata = mem.wdata,
+    .mem_rdata = mem.rdata,
+    .registers = {},
+    .fetch_addr = fetch.addr,
+    .fetched_insn = fetch.fetched_insn,
+    .decoder_in = decoder_in,
+    .imm1 = ctrl.imm1,
+    .imm2 = ctrl.imm2,
+    .stall = ctrl.stall,
+    .src1_regid = ctrl.sel_src1_regid,
+    .src2_regid = ctrl.sel_src2_regid,
+    .dest_regid = ctrl.sel_dest_regid,
+    .halt = ctrl.halt,
+    .mem_write = ctrl.mem_write,
+    .mem_read = ctrl.mem_read,
+    .dest_reg_write = ctrl.dest_reg_write,
+    .doing_jif = ctrl.doing_jif,
+    .stall_fetched_insn_mux = ctrl.stall_fetched_insn_mux,
+  };
+  std::copy(std::begin(reg.registers), std::end(reg.registers), std::begin(r.registers));
+  return r;
 }
 
 
-bool Processor::next_tick() {
+template<bool traced>
+bool Processor::next_tick(u64 max_ticks) {
   // What happens in this function is thought of as simultaneous, so
   // we need to carefully order the propagations to simulate the way
   // it "would have happened" in a real circuit
 
+  hold.held = hold.ticks > 0;
+  if (hold.held) {
+    // Nothing moves while held, so as much of it as allowed is paid at once
+    u32 ticks = u32(std::min<u64>(hold.ticks, std::max<u64>(max_ticks, 1)));
+    hold.ticks -= ticks;
+    stats.ticked += ticks;
+    stats.stalled += ticks;
+    for (int cause = 0; ticks > 0; cause++) {
+      const u32 paid = std::min(ticks, hold.ticks_on[cause]);
+      hold.ticks_on[cause] -= paid;
+      stats.stalled_on[cause] += paid;
+      ticks -= paid;
+    }
+    if (hold.ticks == 0)
+      hold_for_operands();
+    return true;
+  }
+
+  // Bubbles only fetch and decode, so a run of them skips the rest of the
+  // datapath. Fetch through a queue or a predictor is not that simple
+  const auto in_bubble = [&] {
+    return next_ctrl.stall > 0 && next_ctrl.stall < timing::jmp_stall && hold.ticks == 0
+      && !fetch.queue_depth && fetch.predictor.kind == Fetch::Predictor::Kind::none;
+  };
+  if (in_bubble()) {
+    u64 ticks = 0;
+    do {
+      bubble_tick<traced>();
+    } while (++ticks < max_ticks && in_bubble());
+    return true;
+  }
+
   propagate_ctrl_signals();
 
   if (ctrl.halt)
@@ -134,15 +148,63 @@ bool Processor::next_tick() {
   alu_perform();
   reg_writeback();
 
-  print_state();
+  finish_tick<traced>();
+  return true;
+}
+
+template<bool traced>
+void Processor::bubble_tick() {
+  // The same as a whole tick, less whatever a stall neuters: memory is only
+  // read for fetch, nothing is written, fetch goes on past the head, and the
+  // ALU computes nothing anyone keeps
+  propagate_ctrl_signals();
+  reg_readout();
+  mem.addr = fetch.addr;
+  mem.wdata = reg.src2;
+  mem.rdata = mem.fetch(mem.addr);
+  decoder_perform();
+  fetch.fetched_valid = true;
+  fetch.fetched_insn = mem.rdata;
+  fetch.fetched_from = mem.addr;
+  fetch.fetched_predicted = false;
+  fetch.addr++;
+  finish_tick<traced>();
+}
+
+template<bool traced>
+void Processor::finish_tick() {
+  if constexpr (traced) {
+    const u64 tick = stats.ticked;
+    const u32 pc = ctrl.insn_addr;
+    if (tick >= trace_filter.from_tick && tick <= trace_filter.to_tick
+    && pc >= trace_filter.pc_lo && pc <= trace_filter.pc_hi) {
+      if (trace_file)
+        trace_file->write(trace_record());
+      else
+        print_state();
+    }
+  }
 
   stats.ticked++;
-  if (ctrl.stall)
+  if (ctrl.stall) {
     stats.stalled++;
-
-  return true;
+    stats.stalled_on[int(ctrl.stall_cause)]++;
+  }
+  // A jmp is all stalled ticks, and the nops priming the pipeline are not
+  // insns of the program. The halt never gets here
+  if (ctrl.insn_addr != no_insn_pointer
+  && (ctrl.stall == 0 || (ctrl.doing_jmp && ctrl.stall == timing::jmp_stall)))
+    stats.retired++;
+
+  if (timing_config.holds() || ctrl.vec_mem_read || ctrl.vec_mem_write || mem.dma.accesses)
+    hold_after_tick();
+  if (timing_config.scoreboarded() && hold.ticks == 0)
+    hold_for_operands();
 }
 
+template bool Processor::next_tick<true>(u64);
+template bool Processor::next_tick<false>(u64);
+
 void Processor::propagate_ctrl_signals() {
   // Latest decoded signals become current control signals (control register latches)
   ctrl = next_ctrl;
@@ -150,10 +212,22 @@ void Processor::propagate_ctrl_signals() {
   // If control unit is stalled, neuter any signals that would cause visible effects
   if (ctrl.stall > 0) {
     ctrl.mem_write = false;
+    ctrl.mem_xadd = false;
     ctrl.dest_reg_write = false;
+    ctrl.vec_mem_read = false;
+    ctrl.vec_mem_write = false;
+    ctrl.vec_alu = false;
     ctrl.halt = false;
-    if (ctrl.stall < 3)
+    // ... and leave memory and the fetch head to fetch, which is what the stall
+    // is waiting on. A squashed memop or jif would take them over otherwise
+    ctrl.mem_read = true;
+    ctrl.sel_mem_addr = Mem::Addr_mux::from_fetch;
+    ctrl.stall_fetched_insn_mux = false;
+    ctrl.doing_jif = false;
+    if (ctrl.stall < timing::jmp_stall) {
       ctrl.sel_fetch_head = Fetch::Head_mux::from_inc;
+      ctrl.doing_jmp = false;
+    }
   }
 
   { // Verify state
@@ -181,18 +255,96 @@ void Processor::mem_perform() {
   mem.wdata = reg.src2;
 
   if (ctrl.mem_write) {
-    if (mem.addr == mmio_addr)
-      mmio_push(mem.wdata);
-    else if (mem.addr < mem.memory.size())
-      mem.memory[mem.addr] = mem.wdata;
+    mem.write(mem.addr, mem.wdata);
+    if (mem.dma.len)
+      mem.run_dma();
   }
   if (ctrl.mem_read) {
-    if (mem.addr == mmio_addr)
-      mem.rdata = mmio_get();
-    else if (mem.addr < mem.memory.size())
-      mem.rdata = mem.memory[mem.addr];
-    else
-      mem.rdata = 0xBADF00D;
+    mem.rdata = ctrl.sel_mem_addr == Mem::Addr_mux::from_fetch
+      ? mem.fetch(mem.addr)
+      : mem.read(mem.addr);
+  }
+  if (ctrl.mem_xadd) {
+    // Nothing else gets to memory in between, not even another core
+    mem.write(mem.addr, mem.rdata + mem.wdata);
+    if (mem.dma.len)
+      mem.run_dma();
+  }
+
+  // All of the words at once, though the pipeline is then held as if one at a time
+  if (ctrl.vec_mem_read) {
+    for (u32 i = 0; i < vector_width; i++)
+      reg.vdest_from_mem[i] = mem.read(mem.addr + i);
+  }
+  if (ctrl.vec_mem_write) {
+    for (u32 i = 0; i < vector_width; i++)
+      mem.write(mem.addr + i, reg.vectors[ctrl.sel_vsrc1_regid][i]);
+    if (mem.dma.len)
+      mem.run_dma();
+  }
+}
+
+u32 Processor::Mem::read(u32 at) {
+  switch (at) {
+  case mmio_addr: return mmio->get();
+  case num_cores_addr: return num_cores;
+  case core_id_addr: return core_id;
+  case dma_src_addr: return dma.src;
+  case dma_dst_addr: return dma.dst;
+  case dma_len_addr: return 0;
+  case mmio_packed_addr: return 0;
+  case ticked_addr: return u32(*counters.ticked);
+  case stalled_addr: return u32(*counters.stalled);
+  case retired_addr: return u32(*counters.retired);
+  case marker_addr: return 0;
+  default: return memory->load(at);
+  }
+}
+
+u32 Processor::Mem::fetch(u32 at) {
+  return at == mmio_addr ? mmio->get() : memory->load(at);
+}
+
+void Processor::Mem::write(u32 at, u32 value) {
+  switch (at) {
+  case mmio_addr: mmio->push(value); break;
+  case mmio_packed_addr:
+    for (; value != 0; value >>= 8) {
+      if (value & 0xFF)
+        mmio->push(value & 0xFF);
+    }
+    break;
+  case num_cores_addr: case core_id_addr: break;
+  case dma_src_addr: dma.src = value; break;
+  case dma_dst_addr: dma.dst = value; break;
+  case dma_len_addr: dma.len = value; break; // See `run_dma()`
+  case ticked_addr: case stalled_addr: case retired_addr: break;
+  case marker_addr:
+    if (counters.markers)
+      fmt::print(counters.markers, FMT_STRING("{} {}\n"), *counters.ticked, value);
+    break;
+  default: memory->store(at, value); break;
+  }
+}
+
+void Processor::Mem::run_dma() {
+  // Between memory and the MMIO ports only, the other reserved words are just memory to it
+  dma.accesses = 0;
+  dma.stored_at = dma.dst;
+  dma.stored = 0;
+  const bool from_port = is_mmio_port(dma.src);
+  const bool to_port = is_mmio_port(dma.dst);
+  for (; dma.len > 0; dma.len--) {
+    const u32 word = from_port ? read(dma.src) : memory->load(dma.src);
+    if (to_port) {
+      write(dma.dst, word);
+    } else {
+      memory->store(dma.dst, word);
+      dma.stored++;
+    }
+    dma.accesses += !from_port + !to_port;
+    dma.src += !from_port;
+    dma.dst += !to_port;
   }
 }
 
@@ -202,49 +354,272 @@ void Processor::reg_readout() {
 }
 
 void Processor::decoder_perform() {
-  // Decoder decodes last tick's insn, creating next tick's control signals
-  decoder_in = fetch.fetched_insn;
-  next_ctrl = decode_insn(decoder_in);
+  // With a prefetch queue, decode takes its insn off the queue instead of the latch
+  if (fetch.queue_depth) {
+    fetch.fetched_valid = fetch.queue_size > 0;
+    if (fetch.fetched_valid) {
+      const auto& queued = fetch.queue[fetch.queue_head];
+      fetch.fetched_insn = queued.insn;
+      fetch.fetched_from = queued.from;
+      fetch.fetched_predicted = queued.predicted;
+      fetch.queue_head = (fetch.queue_head + 1) % Fetch::max_queue_depth;
+      fetch.queue_size--;
+    }
+  }
 
-  if (ctrl.stall) {
+  if (fetch.fetched_valid) {
+    // Decoder decodes last tick's insn, creating next tick's control signals
+    decoder_in = fetch.fetched_insn;
+    next_ctrl = decode_at(fetch.fetched_from, decoder_in);
+  } else {
+    // Nothing was fetched, because a memop had memory. Rather than decode
+    // the same insn again, interlock with a bubble on the memop's behalf
+    decoder_in = encoded_nop;
+    next_ctrl = decode_insn(encoded_nop);
+    next_ctrl.insn_addr = fetch.held_by;
+    next_ctrl.stall = 1;
+    next_ctrl.stall_cause = timing::Stall::memop;
+  }
+
+  // Fetch is already past a predicted jmp's target, it has nothing left to do
+  if (fetch.fetched_valid && fetch.fetched_predicted) {
+    next_ctrl.predicted_taken = true;
+    if (next_ctrl.doing_jmp) {
+      next_ctrl.stall = 0;
+      next_ctrl.sel_fetch_head = Fetch::Head_mux::from_inc;
+    }
+  }
+
+  // Squash what was fetched in the shadow of a jump. Once the stall is down to
+  // its last tick, the insn being decoded is the target, and it keeps its own
+  // stall: otherwise a jmp right at a jump target would not squash anything
+  if (ctrl.stall > 1) {
     assert(!ctrl.doing_jif);
     next_ctrl.stall = ctrl.stall - 1;
+    next_ctrl.stall_cause = timing::Stall::jump;
   }
 
-  if (ctrl.doing_jif && reg.src1 != 0) {
-    assert(!ctrl.stall);
-    next_ctrl.stall = 2;
+  // Whatever got fetched after a jif that went the other way than fetch did is squashed
+  if (ctrl.doing_jif && (reg.src1 != 0) != ctrl.predicted_taken) {
+    next_ctrl.stall = timing::jif_taken_stall;
+    next_ctrl.stall_cause = timing::Stall::jump;
   }
 }
 
 void Processor::fetch_perform() {
-  if (!ctrl.stall_fetched_insn_mux)
-    fetch.fetched_insn = mem.rdata;
+  const bool fetching = !ctrl.stall_fetched_insn_mux;
+  if (!fetching)
+    fetch.held_by = ctrl.insn_addr;
+  if (!fetch.queue_depth) {
+    fetch.fetched_valid = fetching;
+    if (fetching) {
+      fetch.fetched_insn = mem.rdata;
+      fetch.fetched_from = fetched_from();
+      fetch.fetched_predicted = false;
+    }
+  }
 
+  const u32 head = fetch.addr;
   fetch.next_head_from_inc = fetch.addr + 1;
   fetch.next_head_from_jmp = ctrl.imm1;
 
+  if (fetch.predictor.kind != Fetch::Predictor::Kind::none)
+    resolve_branch();
+
+  bool redirected = true; // By what is executing, as opposed to going on as usual
   fetch.addr = [&] {
     if (ctrl.doing_jif) {
-      if (reg.src1)
+      const bool taken = reg.src1 != 0;
+      if (ctrl.predicted_taken) {
+        // Fetch has been going on from the target all along
+        if (taken) {
+          redirected = false;
+          return fetch.next_head_from_inc;
+        }
+        return ctrl.insn_addr + 1;
+      }
+      if (taken)
         return fetch.next_head_from_jmp;
-      else
-        return fetch.next_head_from_inc;
+      redirected = false;
+      return fetch.next_head_from_inc;
     } else {
       switch (ctrl.sel_fetch_head) {
         using enum Fetch::Head_mux;
       case from_inc:
+        redirected = false;
         return fetch.next_head_from_inc;
       case from_jmp:
         return fetch.next_head_from_jmp;
       case from_same:
+        redirected = false;
         return fetch.addr;
       }
       FATAL("Bad fetch mux");
     }
   }();
+
+  if (fetch.queue_depth) {
+    queue_fetched(fetching, redirected, head);
+    return;
+  }
+
+  if (fetching && !redirected && fetch.predictor.kind != Fetch::Predictor::Kind::none) {
+    u32 target;
+    if (fetch.predictor.predict(fetch.fetched_from, fetch.fetched_insn, target)) {
+      fetch.addr = target;
+      fetch.fetched_predicted = true;
+    }
+  }
+}
+
+void Processor::queue_fetched(bool fetching, bool redirected, u32 head) {
+  // Whatever is queued was fetched down the wrong path, and so was this tick's word
+  if (redirected) {
+    fetch.queue_size = 0;
+    return;
+  }
+
+  // Fetch only moves on past what it managed to queue
+  if (!fetching || fetch.queue_size == fetch.queue_depth) {
+    fetch.addr = head;
+    return;
+  }
+
+  auto& queued = fetch.queue[(fetch.queue_head + fetch.queue_size) % Fetch::max_queue_depth];
+  queued = { .insn = mem.rdata, .from = fetched_from(), .predicted = false };
+  fetch.queue_size++;
+
+  u32 target;
+  if (fetch.predictor.kind != Fetch::Predictor::Kind::none
+  && fetch.predictor.predict(head, queued.insn, target)) {
+    fetch.addr = target;
+    queued.predicted = true;
+  }
+}
+
+void Processor::resolve_branch() {
+  if (ctrl.doing_jif) {
+    const bool taken = reg.src1 != 0;
+    stats.branches++;
+    if (taken != ctrl.predicted_taken)
+      stats.mispredicted++;
+    fetch.predictor.update(ctrl.insn_addr, taken);
+  } else if (ctrl.doing_jmp) {
+    stats.branches++;
+    if (!ctrl.predicted_taken)
+      stats.mispredicted++;
+  }
 }
 
+u32 Processor::fetched_from() const {
+  // Memory is not read only right after priming, and then what fetch gets is the
+  // priming nop. It must not look like it is from the head, or the decode cache
+  // would take it for what really is there
+  return ctrl.mem_read ? mem.addr : no_insn_pointer;
+}
+
+bool Processor::Fetch::Predictor::predict(u32 addr, u32 insn, u32& target) const {
+  switch (static_cast<Opcode>(insn & 0xF)) {
+  case Opcode::jmp:
+    target = insn >> 4;
+    return true;
+  case Opcode::jif:
+    target = insn >> 10;
+    if (kind == Kind::backward_taken)
+      return target <= addr;
+    else {
+      const Entry& entry = table[addr % table_size];
+      return entry.addr == addr && entry.counter >= 2;
+    }
+  default:
+    return false;
+  }
+}
+
+void Processor::Fetch::Predictor::update(u32 addr, bool taken) {
+  Entry& entry = table[addr % table_size];
+  if (entry.addr != addr) {
+    // Start out weakly agreeing with what just happened
+    entry = { .addr = addr, .counter = u8(taken ? 2 : 1) };
+  } else if (taken) {
+    entry.counter = std::min(entry.counter + 1, 3);
+  } else {
+    entry.counter = std::max(entry.counter - 1, 0);
+  }
+}
+
+// ===========================================================================
+// Slow parts, as configured
+
+void Processor::hold_after_tick() {
+  const auto hold_for = [&] (u32 ticks, timing::Stall cause) {
+    if (ticks == 0)
+      return;
+    hold.ticks += ticks;
+    hold.ticks_on[int(cause)] += ticks;
+    hold.insn_addr = ctrl.insn_addr;
+  };
+
+  // Memory was accessed exactly once, either for fetch or for a memop, except
+  // that a vector memop has it for every word in turn. MMIO is not cached
+  if (ctrl.sel_mem_addr == Mem::Addr_mux::from_fetch) {
+    if (mem.icache.enabled() && mem.addr != mmio_addr)
+      hold_for(mem.icache.access(mem.addr) - 1, timing::Stall::fetch);
+  } else {
+    const u32 words = (ctrl.vec_mem_read || ctrl.vec_mem_write) ? vector_width : 1;
+    u32 latency = 0;
+    for (u32 addr = mem.addr; addr != mem.addr + words; addr++) {
+      latency += mem.dcache.enabled() && !is_mmio_port(addr)
+        ? mem.dcache.access(addr)
+        : timing_config.memory_latency;
+    }
+    // A DMA transfer goes straight to memory, past the cache
+    latency += std::exchange(mem.dma.accesses, 0) * timing_config.memory_latency;
+    hold_for(latency - 1, timing::Stall::memory);
+  }
+
+  // A squashed insn is not paid for, and has all of these neutered anyway
+  const bool jumped = (ctrl.doing_jmp && ctrl.stall == timing::jmp_stall)
+    || (ctrl.doing_jif && (reg.src1 != 0) != ctrl.predicted_taken);
+  if (jumped)
+    hold_for(timing_config.jump_penalty, timing::Stall::jump);
+  else if (ctrl.stall == 0 && ctrl.dest_reg_write && ctrl.sel_reg_dest == Reg::Dest_mux::from_alu
+  && !timing_config.muldiv_pipelined)
+    hold_for(alu_latency(ctrl.sel_alu_op) - 1, timing::Stall::muldiv);
+
+  // Executed on the tick before this one, and ready some ticks after
+  if (timing_config.scoreboarded() && ctrl.dest_reg_write) {
+    const bool slow = ctrl.sel_reg_dest == Reg::Dest_mux::from_alu;
+    reg.ready_at[ctrl.sel_dest_regid] = slow ? stats.ticked - 1 + alu_latency(ctrl.sel_alu_op) : 0;
+  }
+}
+
+void Processor::hold_for_operands() {
+  // The insn that executes next, unless it is squashed
+  if (next_ctrl.stall > 0)
+    return;
+  u64 ready = 0;
+  if (next_ctrl.reads_src1)
+    ready = std::max(ready, reg.ready_at[next_ctrl.sel_src1_regid]);
+  if (next_ctrl.reads_src2)
+    ready = std::max(ready, reg.ready_at[next_ctrl.sel_src2_regid]);
+  if (ready > stats.ticked) {
+    hold.ticks = u32(ready - stats.ticked);
+    hold.ticks_on[int(timing::Stall::muldiv)] = hold.ticks;
+    hold.insn_addr = next_ctrl.insn_addr;
+  }
+}
+
+u32 Processor::alu_latency(Alu::Op op) const {
+  switch (op) {
+  case Alu::Op::mul: return timing_config.mul_latency;
+  case Alu::Op::div:
+  case Alu::Op::mod: return timing_config.div_latency;
+  default: return 1;
+  }
+}
+
+
 void Processor::alu_perform() {
   alu.op1_from_src1 = reg.src1;
   alu.op1_from_imm1 = ctrl.imm1;
@@ -258,19 +633,54 @@ void Processor::alu_perform() {
     ? (alu.op2_from_src2)
     : (alu.op2_from_imm2);
 
-  alu.result = [&] {
-    switch (ctrl.sel_alu_op) {
-    case Alu::Op::add: return alu.src1 + alu.src2;
-    case Alu::Op::sub: return alu.src1 - alu.src2;
-    case Alu::Op::mul: return alu.src1 * alu.src2;
-    case Alu::Op::div: return alu.src1 / alu.src2;
-    case Alu::Op::mod: return alu.src1 % alu.src2;
-    case Alu::Op::equ: return (alu.src1 == alu.src2) ? 1u : 0u;
-    case Alu::Op::lt: return (alu.src1 < alu.src2) ? 1u : 0u;
-    case Alu::Op::gt: return (alu.src1 > alu.src2) ? 1u : 0u;
-    }
-    FATAL("Bad ALU op");
-  } ();
+  alu.result = Alu::compute(ctrl.sel_alu_op, alu.src1, alu.src2);
+
+  if (ctrl.vec_alu) {
+    const u32* vsrc1 = reg.vectors[ctrl.sel_vsrc1_regid];
+    const u32* vsrc2 = reg.vectors[ctrl.sel_vsrc2_regid];
+    for (u32 i = 0; i < vector_width; i++)
+      alu.vresult[i] = Alu::compute(ctrl.sel_alu_op, vsrc1[i], vsrc2[i]);
+  }
+}
+
+auto Processor::Alu::op_of_vector_op(Vector_op op) -> Op {
+  switch (op) {
+  case Vector_op::add: return Op::add;
+  case Vector_op::sub: return Op::sub;
+  case Vector_op::mul: return Op::mul;
+  case Vector_op::cmp_equ: return Op::equ;
+  case Vector_op::cmp_gt: return Op::gt;
+  case Vector_op::cmp_lt: return Op::lt;
+  default: return {}; // don't care
+  }
+}
+
+auto Processor::Alu::op_of_binop(u32 opcode) -> Op {
+  switch (static_cast<Opcode>(opcode)) {
+  case Opcode::add: return Op::add;
+  case Opcode::sub: return Op::sub;
+  case Opcode::mul: return Op::mul;
+  case Opcode::div: return Op::div;
+  case Opcode::mod: return Op::mod;
+  case Opcode::cmp_equ: return Op::equ;
+  case Opcode::cmp_lt: return Op::lt;
+  case Opcode::cmp_gt: return Op::gt;
+  default: return {}; // don't care
+  }
+}
+
+u32 Processor::Alu::compute(Op op, u32 src1, u32 src2) {
+  switch (op) {
+  case Op::add: return src1 + src2;
+  case Op::sub: return src1 - src2;
+  case Op::mul: return src1 * src2;
+  case Op::div: return src1 / src2;
+  case Op::mod: return src1 % src2;
+  case Op::equ: return (src1 == src2) ? 1u : 0u;
+  case Op::lt: return (src1 < src2) ? 1u : 0u;
+  case Op::gt: return (src1 > src2) ? 1u : 0u;
+  }
+  FATAL("Bad ALU op");
 }
 
 void Processor::reg_writeback() {
@@ -283,9 +693,24 @@ void Processor::reg_writeback() {
     case Reg::Dest_mux::from_alu: dest = reg.dest_mux_from_alu; break;
     }
   }
+  if (ctrl.vec_mem_read || ctrl.vec_alu) {
+    const u32* from = ctrl.vec_alu ? alu.vresult : reg.vdest_from_mem;
+    std::copy(from, from + vector_width, reg.vectors[ctrl.sel_vdest_regid]);
+  }
 }
 
 
+auto Processor::decode_at(u32 addr, u32 insn) -> Control_signals {
+  auto& entry = decode_cache.entries[addr % Decode_cache::size];
+  if (entry.valid && entry.addr == addr && entry.insn == insn)
+    return entry.signals;
+
+  Control_signals result = decode_insn(insn);
+  result.insn_addr = addr;
+  entry = { .addr = addr, .insn = insn, .valid = true, .signals = result };
+  return result;
+}
+
 auto Processor::decode_insn(u32 insn) -> Control_signals {
   // Decoder is magic
   Control_signals result {};
@@ -305,10 +730,12 @@ auto Processor::decode_insn(u32 insn) -> Control_signals {
     break;
 
   case Opcode::load:
-  case Opcode::store: {
+  case Opcode::store:
+  case Opcode::xadd: {
     if (insn & (1u << 10)) {
       result.sel_mem_addr = Mem::Addr_mux::from_src1;
       result.sel_src1_regid = (insn >> 11) & 0x3F;
+      result.reads_src1 = true;
     } else {
       result.sel_mem_addr = Mem::Addr_mux::from_imm1;
       result.imm1 = insn >> 11;
@@ -317,12 +744,21 @@ auto Processor::decode_insn(u32 insn) -> Control_signals {
     result.sel_fetch_head = Fetch::Head_mux::from_same;
     result.stall_fetched_insn_mux = true;
 
-    if (opcode == Opcode::load) {
+    if (opcode == Opcode::xadd) {
+      // A load and a store at once, of the same register
+      result.sel_dest_regid = (insn >> 4) & 0x3F;
+      result.sel_src2_regid = (insn >> 4) & 0x3F;
+      result.reads_src2 = true;
+      result.sel_reg_dest = Reg::Dest_mux::from_mem;
+      result.dest_reg_write = true;
+      result.mem_xadd = true;
+    } else if (opcode == Opcode::load) {
       result.sel_dest_regid = (insn >> 4) & 0x3F;
       result.sel_reg_dest = Reg::Dest_mux::from_mem;
       result.dest_reg_write = true;
     } else {
       result.sel_src2_regid = (insn >> 4) & 0x3F;
+      result.reads_src2 = true;
       result.mem_write = true;
       result.mem_read = false;
     }
@@ -330,32 +766,67 @@ auto Processor::decode_insn(u32 insn) -> Control_signals {
     break;
   }
   case Opcode::jmp: {
-    result.stall = 3;
+    result.stall = timing::jmp_stall;
     result.sel_fetch_head = Fetch::Head_mux::from_jmp;
+    result.doing_jmp = true;
     result.imm1 = insn >> 4;
     break;
   }
   case Opcode::jif: {
     result.sel_src1_regid = (insn >> 4) & 0x3F;
+    result.reads_src1 = true;
     result.sel_fetch_head = Fetch::Head_mux::from_jmp;
     result.doing_jif = true;
     result.imm1 = insn >> 10;
     break;
   }
+  case Opcode::vec: {
+    const auto op = static_cast<Vector_op>((insn >> 4) & 0x7);
+    const u8 vreg = (insn >> 7) & 0x7;
+    if (op == Vector_op::load || op == Vector_op::store) {
+      // Like any memop, except that the scalar side of memory is left alone
+      if (insn & (1u << 10)) {
+        result.sel_mem_addr = Mem::Addr_mux::from_src1;
+        result.sel_src1_regid = (insn >> 11) & 0x3F;
+        result.reads_src1 = true;
+      } else {
+        result.sel_mem_addr = Mem::Addr_mux::from_imm1;
+        result.imm1 = insn >> 11;
+      }
+      result.sel_fetch_head = Fetch::Head_mux::from_same;
+      result.stall_fetched_insn_mux = true;
+      result.mem_read = false;
+      if (op == Vector_op::load) {
+        result.sel_vdest_regid = vreg;
+        result.vec_mem_read = true;
+      } else {
+        result.sel_vsrc1_regid = vreg;
+        result.vec_mem_write = true;
+      }
+    } else {
+      result.sel_alu_op = Alu::op_of_vector_op(op);
+      result.sel_vdest_regid = vreg;
+      result.sel_vsrc1_regid = (insn >> 10) & 0x7;
+      result.sel_vsrc2_regid = (insn >> 13) & 0x7;
+      result.vec_alu = true;
+    }
+    break;
+  }
   default: {
     // Binop
-    result.sel_alu_op = binop_to_alu(opcode);
-    const auto decode = [&] (u32 encoded, Alu::Src_mux& sel, u8& regid, u32& imm) {
+    result.sel_alu_op = Alu::op_of_binop(insn & 0xF);
+    const auto decode = [&] (u32 encoded, Alu::Src_mux& sel, u8& regid, bool& reads, u32& imm) {
       if (encoded & 1u) {
         sel = Alu::Src_mux::from_src_reg;
         regid = (encoded >> 1) & 0x3F;
+        reads = true;
       } else {
         sel = Alu::Src_mux::from_imm;
         imm = encoded >> 1;
       }
     };
-    decode((insn >> 10) & 0x7FF, result.sel_alu_src1, result.sel_src1_regid, result.imm1);
-    decode((insn >> 21) & 0x7FF, result.sel_alu_src2, result.sel_src2_regid, result.imm2);
+    decode((insn >> 10) & 0x7FF, result.sel_alu_src1, result.sel_src1_regid, result.reads_src1, result.imm1);
+    decode((insn >> 21) & 0x7FF, result.sel_alu_src2, result.sel_src2_regid, result.reads_src2, result.imm2);
 
     result.dest_reg_write = true;
     result.sel_reg_dest = Reg::Dest_mux::from_alu;
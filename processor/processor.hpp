@@ -1,32 +1,117 @@
 #pragma once
+#include "cache.hpp"
+#include "isa.hpp"
+#include "memory.hpp"
+#include "timing.hpp"
 #include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <memory>
 #include <span>
 #include <vector>
 
 using u8 = uint8_t;
 using u16 = uint16_t;
 using u32 = uint32_t;
+using u64 = uint64_t;
+
+struct Mmio;
+Mmio& console_mmio();
+struct Trace_record;
+struct Trace_writer;
 
 struct Processor {
-  explicit Processor(std::span<const u32> image);
-  bool next_tick(); // returns: whether halted
+  explicit Processor(std::span<const u32> image, Mmio& = console_mmio());
+  // One of several cores on the same memory, all of them starting at 0
+  Processor(std::shared_ptr<Paged_memory>, Mmio&, u32 core_id = 0, u32 num_cores = 1);
+  Processor(const Processor&) = delete; // Memory reads the counters out of `stats`
+  Processor& operator=(const Processor&) = delete;
+  static std::shared_ptr<Paged_memory> load_image(std::span<const u32> image);
+  // Without tracing, the tick is simulated with no logging code at all in the way.
+  // A run of held ticks or of bubbles is taken in one go, up to `max_ticks` of
+  // it, with every tick of it still traced; whoever does not care how far it
+  // got in between can let it
+  template<bool traced = true>
+  bool next_tick(u64 max_ticks = 1); // returns: whether halted
 
   void print_state();
+  Trace_record trace_record() const;
+  Trace_writer* trace_file = nullptr; // If set, ticks are traced there instead of as text
+
+  // Only ticks within both windows are traced. Bounds are inclusive,
+  // and the PC is that of the insn being executed
+  struct {
+    u64 from_tick = 0;
+    u64 to_tick = std::numeric_limits<u64>::max();
+    u32 pc_lo = 0;
+    u32 pc_hi = std::numeric_limits<u32>::max();
+  } trace_filter;
+
+  // Functional (ISA-level) execution: one whole instruction per call, straight
+  // from the encoding, without modelling the pipeline at all. Only memory,
+  // registers and `functional` are meaningful; `stats` are an estimate.
+  bool next_insn(); // returns: whether halted
 
   struct {
-    int ticked = 0;
-    int stalled = 0;
+    u32 insn_pointer = 0;
+    bool after_memop = false; // The memop's second tick is not accounted for yet
+  } functional;
+
+  // Switching between the two. The pipeline starts over empty at the insn, as
+  // on reset; it can only be left once it has a next insn decoded for sure
+  void prime_pipeline(u32 insn_pointer);
+  static constexpr u32 no_insn_pointer = std::numeric_limits<u32>::max();
+  u32 next_insn_pointer() const; // returns: `no_insn_pointer` if not yet known
+
+  timing::Config timing_config; // Honoured by all of the models, except for caches
+  void set_timing_config(const timing::Config&);
+
+  struct {
+    u64 ticked = 0;
+    u64 stalled = 0;
+    u64 stalled_on[timing::num_stall_causes] = {}; // The same, by what was waited on
+    u64 retired = 0; // Insns executed, not counting the halt
+    int branches = 0; // Only counted with a branch predictor
+    int mispredicted = 0;
   } stats;
 
+  // Everything above and below, to be picked up later exactly where it was left
+  void save_snapshot(const char* filename) const;
+  void load_snapshot(const char* filename);
+
   // =========================================================================
   // Processor state...
 
   struct Mem {
-    std::vector<u32> memory;
+    std::shared_ptr<Paged_memory> memory; // Shared with other cores, if any
+    Mmio* mmio; // Whoever is on the other side of the MMIO port
+    u32 core_id;
+    u32 num_cores;
+    struct {
+      u32 src;
+      u32 dst;
+      u32 len; // Only nonzero between being written and the transfer
+      u32 accesses; // Of memory by the last transfer, not yet paid for
+      u32 stored_at; // What memory the last transfer stored to, which
+      u32 stored; // whoever keeps copies of code has to know about
+    } dma;
+    Cache icache; // Only tell how long it takes, if configured at all
+    Cache dcache;
+    struct { // What the performance counters read, and where markers go (see isa.hpp)
+      const u64* ticked;
+      const u64* stalled;
+      const u64* retired;
+      std::FILE* markers; // Dropped if not set
+    } counters;
     u32 addr;
     u32 wdata;
     u32 rdata;
 
+    u32 read(u32 addr);
+    void write(u32 addr, u32 value);
+    u32 fetch(u32 addr); // Sees the words under the core registers, as an insn
+    void run_dma(); // The whole of a transfer, once its length is written
+
     enum class Addr_mux: u8 { from_fetch, from_imm1, from_src1 };
     u32 addr_mux_from_fetch;
     u32 addr_mux_from_imm1;
@@ -35,6 +120,9 @@ struct Processor {
 
   struct Reg {
     u32 registers[64];
+    u64 ready_at[64]; // Not a wire, the tick a pipelined mul or div result is there by
+    u32 vectors[num_vector_registers][vector_width];
+    u32 vdest_from_mem[vector_width];
     u32 src1;
     u32 src2;
     u32 dest;
@@ -56,6 +144,11 @@ struct Processor {
     u32 src1;
     u32 src2;
     u32 result;
+    u32 vresult[vector_width]; // Lane by lane, of the vector operands
+
+    static Op op_of_binop(u32 opcode);
+    static Op op_of_vector_op(Vector_op);
+    static u32 compute(Op, u32 src1, u32 src2);
   } alu = {};
 
   struct Fetch {
@@ -65,8 +158,45 @@ struct Processor {
     u32 next_head_from_jmp;
 
     u32 fetched_insn;
+    u32 fetched_from; // Not really a wire, only used to look up the decode cache
+    bool fetched_predicted; // Fetch went on to this insn's target instead of past it
+    bool fetched_valid; // Not if a memop had memory, then the latch is stale
+    u32 held_by; // The memop that last had memory, to pin the bubble on
 
     u32 addr;
+
+    // Optional queue of fetched insns waiting for decode. Fetch fills it on
+    // every tick that a memop does not take memory for, so decode can go on
+    // through a memop off what was fetched before it. With no queue, decode
+    // takes `fetched_insn` straight from the latch
+    struct Queued_insn {
+      u32 insn;
+      u32 from;
+      bool predicted;
+    };
+    static constexpr u32 max_queue_depth = 8;
+    Queued_insn queue[max_queue_depth];
+    u8 queue_depth; // 0 for no queue
+    u8 queue_head;
+    u8 queue_size;
+
+    // Guesses whether a branch is taken as soon as it is fetched, so that fetch
+    // can go on from its target instead of waiting for it to execute. Targets
+    // are immediates, so they are there in the fetched word.
+    // A jmp is always taken; a jif is either predicted taken if it jumps
+    // backward, or by a 2-bit saturating counter of how it went before
+    struct Predictor {
+      enum class Kind: u8 { none, backward_taken, two_bit } kind;
+
+      static constexpr u32 table_size = 64; // Direct-mapped, tagged by address
+      struct Entry {
+        u32 addr;
+        u8 counter; // 0..1 predict not taken, 2..3 taken
+      } table[table_size];
+
+      bool predict(u32 addr, u32 insn, u32& target) const; // returns: whether taken
+      void update(u32 addr, bool taken);
+    } predictor;
   } fetch = {};
 
   u32 decoder_in = 0; // Instruction to decode
@@ -74,10 +204,12 @@ struct Processor {
   // Decoder output
   struct Control_signals {
     bool halt; // Not really a wire in the processor, but we use it to stop simulation
+    u32 insn_addr; // Nor this, it is the PC of the insn (only a predictor would want it)
     u8 stall;
 
     bool mem_write;
     bool mem_read;
+    bool mem_xadd; // Write back what is read plus `wdata`, on the same tick
     Mem::Addr_mux sel_mem_addr;
 
     Reg::Dest_mux sel_reg_dest;
@@ -91,8 +223,21 @@ struct Processor {
     Alu::Src_mux sel_alu_src2;
 
     Fetch::Head_mux sel_fetch_head;
+    bool doing_jmp;
     bool doing_jif;
+    bool predicted_taken;
     bool stall_fetched_insn_mux;
+    timing::Stall stall_cause;
+    bool reads_src1; // Not wires either, only whoever waits for results wants them
+    bool reads_src2;
+
+    // The vector unit is only clocked for these, and uses `sel_alu_op` for its lanes
+    bool vec_mem_read; // Into `sel_vdest_regid`
+    bool vec_mem_write; // From `sel_vsrc1_regid`
+    bool vec_alu;
+    u8 sel_vdest_regid;
+    u8 sel_vsrc1_regid;
+    u8 sel_vsrc2_regid;
 
     u32 imm1;
     u32 imm2;
@@ -102,11 +247,44 @@ struct Processor {
 
   static Control_signals decode_insn(u32);
 
+  // The whole pipeline held still, paying for a slow part (see timing.hpp)
+  struct {
+    u32 ticks; // Still to go
+    u32 ticks_on[timing::num_stall_causes]; // ... the same, by cause, paid in that order
+    u32 insn_addr; // Of the insn that is paying
+    bool held; // Whether the last tick was one of them
+  } hold = {};
+
+  // Decoding depends only on the insn word, so the simulator remembers it per
+  // address, along with the word it was for. Code is just memory, and any core
+  // or DMA might have stored over it since, so a hit has to be for the same word
+  struct Decode_cache {
+    static constexpr u32 size = 1024; // Direct-mapped
+
+    struct Entry {
+      u32 addr;
+      u32 insn;
+      bool valid;
+      Control_signals signals;
+    };
+    std::vector<Entry> entries = std::vector<Entry>(size);
+  } decode_cache;
+
+  Control_signals decode_at(u32 addr, u32 insn);
+
+  template<bool traced> void bubble_tick();
+  template<bool traced> void finish_tick(); // Trace it, count it, and pay for it
   void propagate_ctrl_signals();
   void mem_perform();
   void reg_readout();
   void decoder_perform();
   void fetch_perform();
+  void queue_fetched(bool fetching, bool redirected, u32 head);
+  u32 fetched_from() const;
+  void resolve_branch();
+  void hold_after_tick();
+  void hold_for_operands();
+  u32 alu_latency(Alu::Op) const;
   void alu_perform();
   void reg_writeback();
 };
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include "isa.hpp"
+#include "profile.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+Source_map::Source_map(const char* filename) {
+  std::ifstream in(filename);
+  if (!in)
+    FATAL("Cannot open source map '{}'", filename);
+
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); line_number++) {
+    std::istringstream fields(line);
+    std::string addr_text;
+    Entry entry;
+    if (!(fields >> addr_text >> entry.ir_index >> entry.stack))
+      FATAL("{}:{}: Expected '<address> <ir index> <stack>'", filename, line_number);
+    char* end;
+    const auto addr = std::strtoul(addr_text.c_str(), &end, 0);
+    if (*end != '\0')
+      FATAL("{}:{}: Bad address '{}'", filename, line_number, addr_text);
+    entries[u32(addr)] = std::move(entry);
+  }
+}
+
+auto Source_map::find(u32 addr) const -> const Entry* {
+  auto it = entries.find(addr);
+  return it == entries.end() ? nullptr : &it->second;
+}
+
+
+void Profiler::after_tick(const Processor& proc) {
+  const auto& ctrl = proc.ctrl;
+
+  // Nothing moved, whoever held the pipeline pays
+  if (proc.hold.held) {
+    Counters& counters = by_pc[proc.hold.insn_addr];
+    counters.ticks++;
+    counters.bubbles++;
+    return;
+  }
+
+  u32 charged_to = ctrl.insn_addr;
+  if (ctrl.stall > 0) {
+    // A jmp is stalled from its own tick on, a taken jif from the one after it.
+    // A memop's bubble is a single tick, and has the memop's address on it
+    if (!prev_stalled) {
+      const bool own = ctrl.stall == timing::jmp_stall || ctrl.stall == 1;
+      bubble_owner = own ? ctrl.insn_addr : prev_insn_addr;
+    }
+    charged_to = bubble_owner;
+  }
+
+  Counters& counters = by_pc[charged_to];
+  counters.ticks++;
+  if (ctrl.stall > 0)
+    counters.bubbles++;
+  else if (ctrl.stall_fetched_insn_mux)
+    counters.fetch_stalls++;
+
+  prev_insn_addr = ctrl.insn_addr;
+  prev_stalled = ctrl.stall > 0;
+}
+
+void Profiler::write_report(std::FILE* out, const Source_map* map) const {
+  std::vector<std::pair<u32, Counters>> sorted(by_pc.begin(), by_pc.end());
+  std::ranges::sort(sorted, [] (const auto& a, const auto& b) {
+    return a.second.ticks != b.second.ticks ? a.second.ticks > b.second.ticks : a.first < b.first;
+  });
+
+  u64 total = 0;
+  for (const auto& [pc, counters]: sorted)
+    total += counters.ticks;
+
+  fmt::print(out, FMT_STRING("{:>10} {:>10} {:>7} {:>10} {:>10}  {}\n"),
+      "address", "ticks", "%", "bubbles", "fetch-stl", "source");
+  for (const auto& [pc, counters]: sorted) {
+    const Source_map::Entry* entry = map ? map->find(pc) : nullptr;
+    fmt::print(out, FMT_STRING("{:>#10x} {:>10} {:>6.2f}% {:>10} {:>10}  {}\n"),
+        pc, counters.ticks, 100.0 * double(counters.ticks) / double(std::max<u64>(total, 1)),
+        counters.bubbles, counters.fetch_stalls, entry ? entry->stack : "?");
+  }
+  fmt::print(out, FMT_STRING("{:>10} {:>10}\n"), "total", total);
+}
+
+void Profiler::write_collapsed_stacks(std::FILE* out, const Source_map* map) const {
+  // Sorted, so the output does not depend on hashing
+  std::map<std::string, u64> stacks;
+  for (const auto& [pc, counters]: by_pc) {
+    const Source_map::Entry* entry = map ? map->find(pc) : nullptr;
+    std::string stack = (entry && entry->stack != "-") ? entry->stack + ';' : std::string();
+    stack += fmt::format(FMT_STRING("{:#x}"), pc);
+    stacks[stack] += counters.ticks;
+  }
+  for (const auto& [stack, ticks]: stacks)
+    fmt::print(out, FMT_STRING("{} {}\n"), stack, ticks);
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "processor.hpp"
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+// ===========================================================================
+// Per-PC cycle profile of the pipeline.
+//
+// Every tick is charged to one instruction address: normally the insn that
+// executes, but bubbles after a jump are charged to the jmp or jif that
+// caused them. Ticks spent with fetch held up by a memop are counted apart.
+
+// What the compiler says about where code came from (see `Hw_image`)
+struct Source_map {
+  explicit Source_map(const char* filename);
+
+  struct Entry {
+    u32 ir_index;
+    std::string stack; // `name@line:col;...`, outermost first
+  };
+  std::unordered_map<u32, Entry> entries; // By address
+
+  const Entry* find(u32 addr) const;
+};
+
+struct Profiler {
+  struct Counters {
+    u64 ticks = 0; // All of them, including the below
+    u64 bubbles = 0; // Jump bubbles charged here
+    u64 fetch_stalls = 0; // Ticks with fetch stalled for this memop
+  };
+  std::unordered_map<u32, Counters> by_pc;
+
+  void after_tick(const Processor&); // Call after every tick that ran
+
+  // Hottest addresses first
+  void write_report(std::FILE*, const Source_map*) const;
+  // `frame;frame;...;address ticks`, as flame graph tools want it
+  void write_collapsed_stacks(std::FILE*, const Source_map*) const;
+
+private:
+  u32 prev_insn_addr = 0;
+  u32 bubble_owner = 0;
+  bool prev_stalled = false;
+};
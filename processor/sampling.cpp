@@ -0,0 +1,86 @@
+#include "sampling.hpp"
+#include "util.hpp"
+#include <cmath>
+
+void Sampler::run(Processor& proc) {
+  // An insn executes on every tick that is not a bubble, and so does a jmp
+  // on the first tick of its own (which would otherwise count as stalled).
+  // A held tick only goes on with the insn that was there
+  const auto tick = [&] (u64& insns_executed) {
+    if (!proc.next_tick<false>())
+      return false;
+    if (!proc.hold.held && (proc.ctrl.stall == 0 || proc.ctrl.doing_jmp))
+      insns_executed++;
+    return true;
+  };
+
+  for (;;) {
+    for (u64 i = 0; i < fast_forward; i++) {
+      if (!proc.next_insn())
+        return;
+      insns++;
+    }
+
+    // The nops the pipeline is primed with do not count as insns
+    const u32 resume_at = proc.functional.insn_pointer;
+    proc.prime_pipeline(resume_at);
+    while (proc.next_insn_pointer() != resume_at) {
+      if (!proc.next_tick<false>())
+        return;
+    }
+
+    Window measured = {};
+    const u64 stalled_before = proc.stats.stalled;
+    while (measured.ticks < window) {
+      // A window cut short by the halt is not representative of anything
+      if (!tick(measured.insns)) {
+        insns += measured.insns;
+        return;
+      }
+      measured.ticks++;
+    }
+    measured.stalled = proc.stats.stalled - stalled_before;
+    windows.push_back(measured);
+    insns += measured.insns;
+
+    // ... and until nothing holds the pipeline, which the functional model would not know of
+    while (proc.next_insn_pointer() == Processor::no_insn_pointer || proc.hold.ticks > 0) {
+      if (!tick(insns))
+        return;
+    }
+    proc.functional.insn_pointer = proc.next_insn_pointer();
+    proc.functional.after_memop = false;
+  }
+}
+
+void Sampler::write_report(std::FILE* out) const {
+  fmt::print(out, FMT_STRING("Sampled: {} windows of {} ticks, {} insns in total\n"),
+      windows.size(), window, insns);
+  if (windows.empty())
+    return;
+
+  // Mean over the windows, with a 95% confidence interval by the normal
+  // approximation, which needs a fair number of windows to be any good
+  struct Estimate { double mean; double bound; };
+  const auto estimate = [&] (auto of_window) {
+    const double n = double(windows.size());
+    double sum = 0, sum_squares = 0;
+    for (const Window& w: windows) {
+      const double x = of_window(w);
+      sum += x;
+      sum_squares += x * x;
+    }
+    const double mean = sum / n;
+    const double variance = n > 1 ? std::max(0.0, (sum_squares - sum * mean) / (n - 1)) : 0.0;
+    return Estimate { mean, 1.96 * std::sqrt(variance / n) };
+  };
+
+  const auto ipc = estimate([] (const Window& w) { return double(w.insns) / double(w.ticks); });
+  const auto stall_rate = estimate([] (const Window& w) { return double(w.stalled) / double(w.ticks); });
+  const auto cpi = estimate([] (const Window& w) { return double(w.ticks) / double(std::max<u64>(w.insns, 1)); });
+
+  fmt::print(out, FMT_STRING("IPC: {:.4f} +- {:.4f}\n"), ipc.mean, ipc.bound);
+  fmt::print(out, FMT_STRING("Stalled: {:.2f}% +- {:.2f}%\n"), 100 * stall_rate.mean, 100 * stall_rate.bound);
+  fmt::print(out, FMT_STRING("Ticked (estimate): {:.0f} +- {:.0f}\n"),
+      double(insns) * cpi.mean, double(insns) * cpi.bound);
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "processor.hpp"
+#include <cstdio>
+#include <vector>
+
+// ===========================================================================
+// Sampled simulation.
+//
+// Runs the program functionally for `fast_forward` insns at a time, and in
+// between, primes the pipeline at wherever that got to and measures it for
+// `window` ticks. The windows together make an estimate of how the pipeline
+// would have run the whole program, at close to the functional model's speed.
+//
+// Each window starts with an empty pipeline, so the ticks it takes to fill
+// are not measured, and neither are the ones spent after the window waiting
+// for a next insn to hand back to the functional model.
+
+struct Sampler {
+  u64 fast_forward = 0;
+  u32 window = 0;
+
+  struct Window {
+    u64 ticks;
+    u64 stalled;
+    u64 insns;
+  };
+  std::vector<Window> windows;
+  u64 insns = 0; // All of them, functional or not
+
+  void run(Processor&); // Until halted
+
+  void write_report(std::FILE*) const;
+};
@@ -0,0 +1,170 @@
+#include "processor.hpp"
+#include "util.hpp"
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+
+// ===========================================================================
+// Snapshots of the whole processor state.
+//
+// The state is dumped as it is laid out in memory, so a snapshot can only be
+// resumed by the same build of the simulator that took it. To catch the worst
+// of that, the header records the sizes of everything that is dumped.
+//
+// MMIO is not a part of the processor: a resumed run just reads input from
+// wherever its stdin is at, and whoever resumes has to arrange for it.
+// Neither is the timing config, but the caches it makes are, so the header
+// has it, and resuming with another one is refused. The header also has how
+// fetch was set up, which the resumed run goes on with.
+
+namespace {
+
+constexpr char magic[8] = { 'C', 'S', 'A', 'S', 'N', 'A', 'P', '6' };
+
+constexpr u32 layout[] = {
+  sizeof(Processor::Reg),
+  sizeof(Processor::Alu),
+  sizeof(Processor::Fetch),
+  sizeof(Processor::Control_signals),
+  sizeof(Processor::hold),
+  sizeof(Cache::Line),
+  sizeof(Cache::stats),
+  sizeof(Processor::stats),
+  sizeof(Processor::functional),
+};
+
+struct Settings {
+  timing::Config timing;
+  Processor::Fetch::Predictor::Kind predictor;
+  u8 queue_depth;
+};
+
+struct Snapshot_file {
+  std::FILE* file;
+  const char* filename;
+
+  Snapshot_file(const char* name, const char* mode): filename(name) {
+    file = std::fopen(filename, mode);
+    if (!file)
+      FATAL("Cannot open snapshot file '{}'", filename);
+  }
+  ~Snapshot_file() { std::fclose(file); }
+  Snapshot_file(const Snapshot_file&) = delete;
+  Snapshot_file& operator=(const Snapshot_file&) = delete;
+
+  void put(const void* data, size_t size) {
+    if (std::fwrite(data, 1, size, file) != size)
+      FATAL("Failed to write snapshot '{}'", filename);
+  }
+  void get(void* data, size_t size) {
+    if (std::fread(data, 1, size, file) != size)
+      FATAL("Snapshot '{}' is truncated", filename);
+  }
+
+  template<typename T> void put(const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    put(&value, sizeof(T));
+  }
+  template<typename T> void get(T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    get(&value, sizeof(T));
+  }
+};
+
+} // anon namespace
+
+
+void Processor::save_snapshot(const char* filename) const {
+  Snapshot_file out(filename, "wb");
+  out.put(magic);
+  out.put(layout);
+  Settings settings;
+  settings.timing = timing_config;
+  settings.predictor = fetch.predictor.kind;
+  settings.queue_depth = fetch.queue_depth;
+  out.put(settings);
+
+  // Only the pages that exist, each prefixed with its number
+  out.put(u32(mem.memory->num_pages()));
+  mem.memory->for_each_page([&] (u32 page_number, const u32* words) {
+    out.put(page_number);
+    out.put(words, Paged_memory::page_words * sizeof(u32));
+  });
+  for (u32 value: { mem.addr, mem.wdata, mem.rdata,
+      mem.addr_mux_from_fetch, mem.addr_mux_from_imm1, mem.addr_mux_from_src1,
+      mem.dma.src, mem.dma.dst })
+    out.put(value);
+  for (const Cache* cache: { &mem.icache, &mem.dcache }) {
+    out.put(u32(cache->lines.size()));
+    out.put(cache->lines.data(), cache->lines.size() * sizeof(Cache::Line));
+    out.put(cache->stats);
+    out.put(cache->uses);
+  }
+
+  out.put(reg);
+  out.put(alu);
+  out.put(fetch);
+  out.put(decoder_in);
+  out.put(next_ctrl);
+  out.put(ctrl);
+  out.put(hold);
+  out.put(stats);
+  out.put(functional);
+}
+
+void Processor::load_snapshot(const char* filename) {
+  Snapshot_file in(filename, "rb");
+
+  char file_magic[sizeof(magic)];
+  in.get(file_magic);
+  if (std::memcmp(file_magic, magic, sizeof(magic)) != 0)
+    FATAL("'{}' is not a snapshot", filename);
+  u32 file_layout[std::size(layout)];
+  in.get(file_layout);
+  if (std::memcmp(file_layout, layout, sizeof(layout)) != 0)
+    FATAL("Snapshot '{}' was taken by a different build of the simulator", filename);
+  Settings settings;
+  in.get(settings);
+  if (!(settings.timing == timing_config))
+    FATAL("Snapshot '{}' was taken with another timing config", filename);
+
+  u32 num_pages;
+  in.get(num_pages);
+  mem.memory->clear();
+  for (u32 i = 0; i < num_pages; i++) {
+    u32 page_number;
+    in.get(page_number);
+    if (page_number >= (1u << (32 - Paged_memory::page_bits)))
+      FATAL("Snapshot '{}' has a bad page number {:#x}", filename, page_number);
+    in.get(mem.memory->page_for_store(page_number), Paged_memory::page_words * sizeof(u32));
+  }
+  for (u32* value: { &mem.addr, &mem.wdata, &mem.rdata,
+      &mem.addr_mux_from_fetch, &mem.addr_mux_from_imm1, &mem.addr_mux_from_src1,
+      &mem.dma.src, &mem.dma.dst })
+    in.get(*value);
+  for (Cache* cache: { &mem.icache, &mem.dcache }) {
+    u32 num_lines;
+    in.get(num_lines);
+    if (num_lines != cache->lines.size())
+      FATAL("Snapshot '{}' was taken with different caches", filename);
+    in.get(cache->lines.data(), num_lines * sizeof(Cache::Line));
+    in.get(cache->stats);
+    in.get(cache->uses);
+  }
+
+  in.get(reg);
+  in.get(alu);
+  in.get(fetch);
+  fetch.predictor.kind = settings.predictor;
+  fetch.queue_depth = settings.queue_depth;
+  in.get(decoder_in);
+  in.get(next_ctrl);
+  in.get(ctrl);
+  in.get(hold);
+  in.get(stats);
+  in.get(functional);
+
+  // Whatever was decoded before is of a different memory
+  decode_cache = {};
+}
@@ -0,0 +1,72 @@
+#include "timing.hpp"
+#include "util.hpp"
+#include <charconv>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+auto timing::Config::load(const char* filename) -> Config {
+  std::ifstream in(filename);
+  if (!in)
+    FATAL("Cannot open timing config '{}'", filename);
+
+  Config config;
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); line_number++) {
+    std::istringstream fields(line);
+    std::string name, value, extra;
+    if (!(fields >> name) || name.starts_with('#'))
+      continue;
+    if (!(fields >> value) || (fields >> extra))
+      FATAL("{}:{}: Expected '<setting> <value>'", filename, line_number);
+
+    const auto number = [&] (uint32_t min) {
+      uint32_t result;
+      auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+      if (ec != std::errc{} || end != value.data() + value.size() || result < min)
+        FATAL("{}:{}: Bad {} '{}'", filename, line_number, name, value);
+      return result;
+    };
+
+    if (name == "memory-latency") {
+      config.memory_latency = number(1);
+    } else if (name == "mul-latency") {
+      config.mul_latency = number(1);
+    } else if (name == "div-latency") {
+      config.div_latency = number(1);
+    } else if (name == "muldiv-pipelined") {
+      if (value == "yes") config.muldiv_pipelined = true;
+      else if (value == "no") config.muldiv_pipelined = false;
+      else FATAL("{}:{}: Expected yes or no, not '{}'", filename, line_number, value);
+    } else if (name == "jump-penalty") {
+      config.jump_penalty = number(0);
+    } else if (name.starts_with("icache-") || name.starts_with("dcache-")) {
+      Cache_config& cache = name.starts_with('i') ? config.icache : config.dcache;
+      const std::string_view what = std::string_view(name).substr(name.find('-') + 1);
+      if (what == "size") cache.size = number(0);
+      else if (what == "ways") cache.ways = number(1);
+      else if (what == "line") cache.line = number(1);
+      else if (what == "hit-latency") cache.hit_latency = number(1);
+      else if (what == "miss-latency") cache.miss_latency = number(1);
+      else FATAL("{}:{}: Unknown setting '{}'", filename, line_number, name);
+    } else {
+      FATAL("{}:{}: Unknown setting '{}'", filename, line_number, name);
+    }
+  }
+
+  // Addresses are split into tag, set and offset by bits
+  const auto check = [&] (const Cache_config& cache, const char* which) {
+    if (cache.size == 0)
+      return;
+    const auto power_of_2 = [] (uint32_t x) { return (x & (x - 1)) == 0; };
+    if (!power_of_2(cache.line) || cache.size % (cache.ways * cache.line) != 0
+    || !power_of_2(cache.size / (cache.ways * cache.line)))
+      FATAL("{}: The {} line size and number of sets should be powers of 2", filename, which);
+    if (cache.miss_latency < cache.hit_latency)
+      FATAL("{}: The {} misses faster than it hits", filename, which);
+  };
+  check(config.icache, "icache");
+  check(config.dcache, "dcache");
+  return config;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+
+// ===========================================================================
+// Configurable timing.
+//
+// The timing rules in isa.hpp are how the pipeline is built and cannot be
+// less than that. These are costs on top of them, to see what a machine with
+// slower parts would make of the same program. While one of them is being
+// paid the whole pipeline is held still, and these held ticks are not traced,
+// since nothing changes in them.
+//
+// A config file has one setting per line, as '<name> <value>'. Empty lines and
+// lines starting with '#' are ignored. Anything not set stays as it is here.
+// Cache settings are named after the cache, as in 'icache-size' or 'dcache-ways'.
+
+namespace timing {
+
+// An L1 cache in front of memory, see cache.hpp. Sizes are in words
+struct Cache_config {
+  uint32_t size = 0; // 0 for no cache at all
+  uint32_t ways = 1;
+  uint32_t line = 4;
+  uint32_t hit_latency = 1;
+  uint32_t miss_latency = 10;
+
+  bool operator==(const Cache_config&) const = default;
+};
+
+struct Config {
+  // Ticks a load or a store keeps memory for, unless the data cache says otherwise
+  uint32_t memory_latency = 1;
+  uint32_t mul_latency = 1; // Ticks until the result of a mul is there
+  uint32_t div_latency = 1; // ... and of a div or a mod
+  // If not, the pipeline waits for a mul or div to finish right after it.
+  // If so, it only waits once an insn wants the result
+  bool muldiv_pipelined = false;
+  uint32_t jump_penalty = 0; // Extra ticks lost to every jump fetch did not see coming
+
+  // Only the pipeline has them, the other models have no idea what is fetched when
+  Cache_config icache;
+  Cache_config dcache;
+
+  static Config load(const char* filename);
+  bool operator==(const Config&) const = default;
+
+  bool has_caches() const { return icache.size > 0 || dcache.size > 0; }
+  bool holds() const { // Whether anything ever holds the pipeline
+    return memory_latency > 1 || mul_latency > 1 || div_latency > 1 || jump_penalty > 0
+      || has_caches();
+  }
+  bool scoreboarded() const { // Whether results have to be waited for
+    return muldiv_pipelined && (mul_latency > 1 || div_latency > 1);
+  }
+};
+
+// What a stalled tick was waiting on
+enum class Stall: uint8_t {
+  jump, // Fetch going the wrong way
+  memop, // The bubble of a memop taking memory away from fetch
+  fetch, // Instruction cache latency
+  memory, // Memory latency, or data cache latency
+  muldiv, // A mul or div that is not done yet
+};
+constexpr int num_stall_causes = 5;
+
+} // namespace timing
@@ -0,0 +1,254 @@
+#include "trace.hpp"
+#include "util.hpp"
+#include <cstring>
+#include <iterator>
+
+// ===========================================================================
+// Text form
+
+void Trace_record::print(std::FILE* out) const {
+  fmt::print(out, FMT_STRING("After tick {}: \n"), tick);
+
+  fmt::print(out, FMT_STRING("  Mem: addr={:#x}, wdata={:#x}, rdata={:#x}\n"),
+    mem_addr, mem_wdata, mem_rdata);
+
+  {
+    int num_nonzero = 0;
+    fmt::print(out, FMT_STRING("  Reg:"));
+    for (int i = 0; i < 64; i++) {
+      if (registers[i] != 0) {
+        fmt::print(out, FMT_STRING(" r{}={:#x};"), i, registers[i]);
+        num_nonzero++;
+      }
+    }
+    if (num_nonzero != 64)
+      fmt::print(out, FMT_STRING(" ({} 0)"), num_nonzero == 0 ? "all" : "others");
+    fmt::print(out, FMT_STRING("\n"));
+  }
+
+  fmt::print(out, FMT_STRING("  Fetch head={:#x} insn={:#x}\n"), fetch_addr, fetched_insn);
+
+  fmt::print(out, FMT_STRING("  Control:"));
+  if (halt) fmt::print(out, FMT_STRING(" +HALT"));
+  if (stall) fmt::print(out, FMT_STRING(" +STALL:{}"), int(stall));
+  if (mem_write) fmt::print(out, FMT_STRING(" +mem-write"));
+  if (mem_read) fmt::print(out, FMT_STRING(" +mem-read"));
+  if (dest_reg_write) fmt::print(out, FMT_STRING(" +dest-write"));
+  fmt::print(out, FMT_STRING(" src1={} src2={} dest={}"), src1_regid, src2_regid, dest_regid);
+  if (doing_jif) fmt::print(out, FMT_STRING(" +jif"));
+  if (stall_fetched_insn_mux) fmt::print(out, FMT_STRING(" +fetch-stall"));
+  fmt::print(out, FMT_STRING(" imm1={:#x} imm2={:#x}\n"), imm1, imm2);
+  fmt::print(out, FMT_STRING("  Decode in={:#x}\n"), decoder_in);
+}
+
+void print_trace_summary(std::FILE* out, u64 ticked, u64 stalled) {
+  fmt::print(out, FMT_STRING("Ticked: {}, stalled: {}\n"), ticked, stalled);
+}
+
+
+// ===========================================================================
+// Binary form
+
+namespace {
+
+constexpr char magic[8] = { 'C', 'S', 'A', 'T', 'R', 'A', 'C', 'E' };
+constexpr u32 version = 1;
+
+constexpr u8 tag_tick = 0x01;
+constexpr u8 tag_summary = 0x02;
+
+// The plain fields, in the order they are written. A record starts with
+// a bitmask of which of them changed, bit N standing for `scalar_fields[N]`
+constexpr u32 Trace_record::* scalar_fields[] = {
+  &Trace_record::mem_addr,
+  &Trace_record::mem_wdata,
+  &Trace_record::mem_rdata,
+  &Trace_record::fetch_addr,
+  &Trace_record::fetched_insn,
+  &Trace_record::decoder_in,
+  &Trace_record::imm1,
+  &Trace_record::imm2,
+};
+constexpr u32 num_scalar_fields = std::size(scalar_fields);
+
+// ... and the same bitmask covers these
+constexpr u32 changed_control = 1u << num_scalar_fields;
+constexpr u32 changed_registers = 1u << (num_scalar_fields + 1);
+
+// The small control signals, packed into one word: 6 flags, the stall
+// counter, and 3 register ids
+u32 pack_control(const Trace_record& r) {
+  return u32(r.halt)
+    | u32(r.mem_write) << 1
+    | u32(r.mem_read) << 2
+    | u32(r.dest_reg_write) << 3
+    | u32(r.doing_jif) << 4
+    | u32(r.stall_fetched_insn_mux) << 5
+    | u32(r.stall) << 6
+    | u32(r.src1_regid) << 14
+    | u32(r.src2_regid) << 20
+    | u32(r.dest_regid) << 26;
+}
+
+void unpack_control(Trace_record& r, u32 packed) {
+  r.halt = packed & 1u;
+  r.mem_write = (packed >> 1) & 1u;
+  r.mem_read = (packed >> 2) & 1u;
+  r.dest_reg_write = (packed >> 3) & 1u;
+  r.doing_jif = (packed >> 4) & 1u;
+  r.stall_fetched_insn_mux = (packed >> 5) & 1u;
+  r.stall = (packed >> 6) & 0xFF;
+  r.src1_regid = (packed >> 14) & 0x3F;
+  r.src2_regid = (packed >> 20) & 0x3F;
+  r.dest_regid = (packed >> 26) & 0x3F;
+}
+
+u32 zigzag(u32 delta) { return (delta << 1) ^ u32(int32_t(delta) >> 31); }
+u32 unzigzag(u32 encoded) { return (encoded >> 1) ^ -(encoded & 1u); }
+
+// Ticks are counted in 64 bits, and a delta that fits in 32 comes out the same
+u64 zigzag(u64 delta) { return (delta << 1) ^ u64(int64_t(delta) >> 63); }
+u64 unzigzag(u64 encoded) { return (encoded >> 1) ^ -(encoded & 1u); }
+
+void put_varint(std::vector<u8>& out, u64 value) {
+  while (value >= 0x80) {
+    out.push_back(u8(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(u8(value));
+}
+
+u64 get_varint(std::FILE* in) {
+  u64 result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = std::fgetc(in);
+    if (byte == EOF)
+      FATAL("Trace is truncated");
+    result |= u64(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return result;
+  }
+  FATAL("Trace has a malformed number");
+}
+
+} // anon namespace
+
+
+Trace_writer::Trace_writer(const char* filename) {
+  file = std::fopen(filename, "wb");
+  if (!file)
+    FATAL("Cannot open trace file '{}'", filename);
+  buffer.reserve(1 << 20);
+  buffer.insert(buffer.end(), std::begin(magic), std::end(magic));
+  put_varint(buffer, version);
+}
+
+Trace_writer::~Trace_writer() {
+  flush();
+  std::fclose(file);
+}
+
+void Trace_writer::flush() {
+  if (!buffer.empty() && std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+    FATAL("Failed to write trace");
+  buffer.clear();
+}
+
+void Trace_writer::write(const Trace_record& r) {
+  // Worst case for a record is well under 1 KiB
+  if (buffer.size() + 1024 > buffer.capacity())
+    flush();
+
+  buffer.push_back(tag_tick);
+  put_varint(buffer, zigzag(r.tick - prev.tick));
+
+  u32 changed = 0;
+  for (u32 i = 0; i < num_scalar_fields; i++) {
+    if (r.*scalar_fields[i] != prev.*scalar_fields[i])
+      changed |= 1u << i;
+  }
+  if (pack_control(r) != pack_control(prev))
+    changed |= changed_control;
+  u64 changed_regs = 0;
+  for (int i = 0; i < 64; i++) {
+    if (r.registers[i] != prev.registers[i])
+      changed_regs |= u64(1) << i;
+  }
+  if (changed_regs)
+    changed |= changed_registers;
+
+  put_varint(buffer, changed);
+  for (u32 i = 0; i < num_scalar_fields; i++) {
+    if (changed & (1u << i))
+      put_varint(buffer, zigzag(r.*scalar_fields[i] - prev.*scalar_fields[i]));
+  }
+  if (changed & changed_control)
+    put_varint(buffer, pack_control(r));
+  if (changed & changed_registers) {
+    put_varint(buffer, changed_regs);
+    for (int i = 0; i < 64; i++) {
+      if (changed_regs & (u64(1) << i))
+        put_varint(buffer, zigzag(r.registers[i] - prev.registers[i]));
+    }
+  }
+
+  prev = r;
+}
+
+void Trace_writer::write_summary(u64 ticked, u64 stalled) {
+  buffer.push_back(tag_summary);
+  put_varint(buffer, ticked);
+  put_varint(buffer, stalled);
+  flush();
+}
+
+
+Trace_reader::Trace_reader(const char* filename) {
+  file = std::fopen(filename, "rb");
+  if (!file)
+    FATAL("Cannot open trace file '{}'", filename);
+
+  char header[sizeof(magic)];
+  if (std::fread(header, 1, sizeof(header), file) != sizeof(header)
+  || std::memcmp(header, magic, sizeof(magic)) != 0)
+    FATAL("'{}' is not a trace file", filename);
+  if (get_varint(file) != version)
+    FATAL("Trace file '{}' is of an unsupported version", filename);
+}
+
+Trace_reader::~Trace_reader() {
+  std::fclose(file);
+}
+
+auto Trace_reader::next() -> Item {
+  const int tag = std::fgetc(file);
+  if (tag == EOF)
+    return Item::end;
+
+  if (tag == tag_summary) {
+    summary.ticked = get_varint(file);
+    summary.stalled = get_varint(file);
+    return Item::summary;
+  }
+  if (tag != tag_tick)
+    FATAL("Trace has a bad record tag {:#x}", tag);
+
+  // Fields which did not change keep their values from the previous record
+  record.tick += unzigzag(get_varint(file));
+  const auto changed = u32(get_varint(file));
+  for (u32 i = 0; i < num_scalar_fields; i++) {
+    if (changed & (1u << i))
+      record.*scalar_fields[i] += unzigzag(u32(get_varint(file)));
+  }
+  if (changed & changed_control)
+    unpack_control(record, u32(get_varint(file)));
+  if (changed & changed_registers) {
+    const u64 changed_regs = get_varint(file);
+    for (int i = 0; i < 64; i++) {
+      if (changed_regs & (u64(1) << i))
+        record.registers[i] += unzigzag(u32(get_varint(file)));
+    }
+  }
+
+  return Item::tick;
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+#include "processor.hpp"
+#include <cstdio>
+#include <vector>
+
+// ===========================================================================
+// Per-tick trace of the processor.
+//
+// A record holds everything the textual proc log shows about one tick.
+// It can be printed as that text right away, or written to a compact binary
+// file and turned into the very same text later by `trace-render`.
+
+struct Trace_record {
+  u64 tick;
+
+  u32 mem_addr;
+  u32 mem_wdata;
+  u32 mem_rdata;
+  u32 registers[64];
+  u32 fetch_addr;
+  u32 fetched_insn;
+  u32 decoder_in;
+
+  // Control signals, only the ones that are shown
+  u32 imm1;
+  u32 imm2;
+  u8 stall;
+  u8 src1_regid;
+  u8 src2_regid;
+  u8 dest_regid;
+  bool halt;
+  bool mem_write;
+  bool mem_read;
+  bool dest_reg_write;
+  bool doing_jif;
+  bool stall_fetched_insn_mux;
+
+  void print(std::FILE*) const;
+};
+
+void print_trace_summary(std::FILE*, u64 ticked, u64 stalled);
+
+
+// Binary trace file format:
+//
+//   "CSATRACE" u32-version
+//   { 0x01 tick-record | 0x02 summary }...
+//
+// A tick record is the tick number, then a bitmask of which fields changed
+// since the previous record, then just the changed fields. Numbers are written
+// as varints of the zigzagged difference from their previous value, so most
+// fields of most records take a single byte, or nothing at all.
+
+struct Trace_writer {
+  explicit Trace_writer(const char* filename);
+  ~Trace_writer();
+  Trace_writer(const Trace_writer&) = delete;
+  Trace_writer& operator=(const Trace_writer&) = delete;
+
+  void write(const Trace_record&);
+  void write_summary(u64 ticked, u64 stalled);
+
+private:
+  std::FILE* file;
+  std::vector<u8> buffer;
+  Trace_record prev = {};
+
+  void flush();
+};
+
+struct Trace_reader {
+  explicit Trace_reader(const char* filename);
+  ~Trace_reader();
+  Trace_reader(const Trace_reader&) = delete;
+  Trace_reader& operator=(const Trace_reader&) = delete;
+
+  enum class Item { tick, summary, end };
+  Item next();
+
+  Trace_record record = {}; // Valid after `next()` returns `Item::tick`
+  struct { u64 ticked; u64 stalled; } summary = {}; // ... `Item::summary`
+
+private:
+  std::FILE* file;
+};
\ No newline at end of file
@@ -0,0 +1,573 @@
+#include "isa.hpp"
+#include "translator.hpp"
+#include "util.hpp"
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+constexpr size_t buffer_size = 16 << 20;
+constexpr size_t max_block_bytes = 64 << 10; // Generously over what max_block_insns can produce
+constexpr int max_block_insns = 256;
+
+// What translated code returns to `Translator::run()`: the address to continue
+// at in the low 32 bits, plus what to do about it in the high ones
+constexpr u64 exit_interpret = u64(1) << 32; // Have the functional model do this insn
+constexpr u64 exit_after_memop = u64(1) << 33; // ... and it follows a memop
+
+// Raw x86-64 machine code, written straight into the translation buffer.
+// Positions are offsets into the buffer.
+struct Emitter {
+  std::byte* base;
+  size_t pos;
+
+  // Register numbers as the encoding wants them
+  static constexpr int eax = 0;
+  static constexpr int ecx = 1;
+  static constexpr int edx = 2;
+
+  void bytes(std::initializer_list<int> bs) {
+    for (int b: bs)
+      base[pos++] = std::byte(b);
+  }
+  void imm32(u32 value) {
+    std::memcpy(base + pos, &value, sizeof(value));
+    pos += sizeof(value);
+  }
+  void imm64(u64 value) {
+    std::memcpy(base + pos, &value, sizeof(value));
+    pos += sizeof(value);
+  }
+  void patch_rel32(size_t at, size_t target) {
+    const auto rel = static_cast<int32_t>(target - (at + 4));
+    std::memcpy(base + at, &rel, sizeof(rel));
+  }
+
+  // The ISA's registers live in memory at [rbx], the memory's page cache
+  // is at [r12] and `Translator::State` is at [r14].
+
+  void load_isa_reg(int dest, u32 regid) { // mov dest, [rbx + 4*regid]
+    bytes({ 0x8B, 0x83 | (dest << 3) });
+    imm32(regid * 4);
+  }
+  void store_isa_reg(u32 regid, int src) { // mov [rbx + 4*regid], src
+    bytes({ 0x89, 0x83 | (src << 3) });
+    imm32(regid * 4);
+  }
+  void load_imm(int dest, u32 value) { // mov dest, imm32
+    bytes({ 0xB8 + dest });
+    imm32(value);
+  }
+  void add_to_state(size_t offset, u64 value) { // add qword [r14 + offset], imm32
+    if (value == 0)
+      return;
+    bytes({ 0x49, 0x81, 0x86 });
+    imm32(u32(offset));
+    imm32(u32(value));
+  }
+
+  size_t jcc_rel32(int cc) { // Returns where the rel32 is, to be patched
+    bytes({ 0x0F, 0x80 | cc });
+    imm32(0);
+    return pos - 4;
+  }
+  size_t jmp_rel32() {
+    bytes({ 0xE9 });
+    imm32(0);
+    return pos - 4;
+  }
+
+  static constexpr int cc_below = 0x2;
+  static constexpr int cc_above_equal = 0x3;
+  static constexpr int cc_equal = 0x4;
+  static constexpr int cc_not_equal = 0x5;
+};
+
+} // anon namespace
+
+
+#if defined(__x86_64__)
+
+namespace {
+
+// Translation buffer layout:
+//   [trampoline] [exit] [blocks...]
+// The trampoline saves callee-saved registers, sets up the ones translated
+// code relies on, and jumps into a block. Blocks leave through `exit`.
+// Their sizes are fixed, so every translator on every thread agrees on them
+constexpr size_t trampoline_pos = 0;
+constexpr size_t exit_pos = trampoline_pos + 29;
+constexpr size_t blocks_pos = exit_pos + 11;
+
+using Entry = u64 (*)(Translator::State*, const std::byte* block);
+
+void emit_glue(Emitter& e) {
+  e.pos = trampoline_pos;
+  e.bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 }); // push rbx..r15
+  e.bytes({ 0x49, 0x89, 0xFE }); // mov r14, rdi
+  e.bytes({ 0x49, 0x8B, 0x9E }); // mov rbx, [r14 + registers]
+  e.imm32(offsetof(Translator::State, registers));
+  e.bytes({ 0x4D, 0x8B, 0xA6 }); // mov r12, [r14 + page_cache]
+  e.imm32(offsetof(Translator::State, page_cache));
+  e.bytes({ 0xFF, 0xE6 }); // jmp rsi
+
+  assert(e.pos == exit_pos);
+  e.bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B }); // pop r15..rbx
+  e.bytes({ 0xC3 }); // ret
+
+  assert(e.pos == blocks_pos);
+}
+
+} // anon namespace
+
+
+Translator::Translator(Processor& p): proc(p) {
+  void* mapped = mmap(
+    nullptr, buffer_size,
+    PROT_READ | PROT_WRITE, // Made executable once there is something to run
+    MAP_PRIVATE | MAP_ANONYMOUS,
+    -1, 0
+  );
+  if (mapped == MAP_FAILED)
+    FATAL("Cannot map a buffer for translated code");
+  buffer = static_cast<std::byte*>(mapped);
+
+  Emitter e { .base = buffer, .pos = 0 };
+  emit_glue(e);
+
+  state.registers = proc.reg.registers;
+  state.page_cache = proc.mem.memory->cache.data();
+  flush();
+}
+
+Translator::~Translator() {
+  munmap(buffer, buffer_size);
+}
+
+bool Translator::run(u64 max_ticks) {
+  if (proc.timing_config.scoreboarded()) {
+    while (proc.stats.ticked < max_ticks)
+      if (!proc.next_insn())
+        return false;
+    return true;
+  }
+  if (proc.stats.ticked == 0) // Account for the pipeline filling up before the first insn
+    proc.stats.ticked = timing::pipeline_fill;
+
+  const auto enter = reinterpret_cast<Entry>(buffer + trampoline_pos);
+
+  while (proc.stats.ticked < max_ticks) {
+    auto& pointer = proc.functional.insn_pointer;
+
+    // Blocks do not know what came before them, so the tail of a memop
+    // is settled by the functional model
+    Block block = proc.functional.after_memop ? nullptr : lookup_or_translate(pointer);
+    if (!block) {
+      if (!interpret_one())
+        return false;
+      continue;
+    }
+
+    state.tick_limit = max_ticks - proc.stats.ticked; // `state.ticked` is 0 after a sync
+    make_writable(false);
+    const u64 exit = enter(&state, block);
+    sync_stats();
+    pointer = u32(exit);
+    proc.functional.after_memop = (exit & exit_after_memop) != 0;
+    if ((exit & exit_interpret) && !interpret_one())
+      return false;
+  }
+  return true;
+}
+
+auto Translator::lookup_or_translate(u32 addr) -> Block {
+  if (auto it = blocks.find(addr); it != blocks.end())
+    return it->second;
+  if (!proc.mem.memory->find_page(addr >> Paged_memory::page_bits))
+    return nullptr;
+  if (buffer_used + max_block_bytes > buffer_size)
+    flush();
+  return translate(addr);
+}
+
+// Only flips when it has to, since most blocks are entered many more times
+// than anything gets translated
+void Translator::make_writable(bool want) {
+  if (writable == want)
+    return;
+  if (mprotect(buffer, buffer_size, want ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+    FATAL("Cannot change the protection of translated code");
+  writable = want;
+}
+
+void Translator::flush() {
+  buffer_used = blocks_pos;
+  blocks.clear();
+  unchained.clear();
+  state.code_lo = std::numeric_limits<u32>::max();
+  state.code_span = 0;
+}
+
+void Translator::sync_stats() {
+  proc.stats.ticked += state.ticked;
+  proc.stats.stalled += state.stalled;
+  proc.stats.retired += state.retired;
+  state.ticked = 0;
+  state.stalled = 0;
+  state.retired = 0;
+  for (int i = 0; i < timing::num_stall_causes; i++) {
+    proc.stats.stalled_on[i] += state.stalled_on[i];
+    state.stalled_on[i] = 0;
+  }
+}
+
+bool Translator::interpret_one() {
+  // A store into translated code makes all of it suspect
+  const u32 at = proc.functional.insn_pointer;
+  const u32 insn = proc.mem.memory->load(at);
+  bool hits_code = false;
+  const auto opcode = static_cast<Opcode>(insn & 0xF);
+  const bool vector_store = opcode == Opcode::vec
+    && static_cast<Vector_op>((insn >> 4) & 0x7) == Vector_op::store;
+  if (opcode == Opcode::store || opcode == Opcode::xadd || vector_store) {
+    const u32 addr = (insn & (1u << 10)) ? state.registers[(insn >> 11) & 0x3F] : (insn >> 11);
+    for (u32 i = 0; i < (vector_store ? vector_width : 1); i++)
+      hits_code |= addr + i - state.code_lo < state.code_span;
+  }
+
+  const bool running = proc.next_insn();
+  // ... and so does a DMA transfer into it, which only ever starts here
+  auto& dma = proc.mem.dma;
+  for (; dma.stored > 0; dma.stored--, dma.stored_at++)
+    hits_code |= dma.stored_at - state.code_lo < state.code_span;
+  if (hits_code)
+    flush();
+  return running;
+}
+
+
+// ===========================================================================
+// Translating a block
+
+namespace {
+
+struct Block_translation {
+  Emitter& e;
+  std::unordered_map<u32, const std::byte*>& blocks;
+  std::unordered_map<u32, std::vector<size_t>>& unchained;
+  const Processor& proc;
+
+  // Accumulated cost of the instructions translated so far
+  struct Cost {
+    u64 ticks = 0;
+    u64 stalls[timing::num_stall_causes] = {};
+    u64 insns = 0;
+
+    void stall(timing::Stall cause, u64 n) {
+      ticks += n;
+      stalls[int(cause)] += n;
+    }
+  } cost = {};
+  bool after_memop = false;
+
+  // Jumps out of the middle of the block, to have the functional model
+  // do the instruction at `addr` instead
+  struct Side_exit {
+    std::vector<size_t> jumps;
+    u32 addr;
+    Cost cost;
+    bool after_memop;
+  };
+  std::vector<Side_exit> side_exits;
+
+  void emit_cost(const Cost& with) {
+    e.add_to_state(offsetof(Translator::State, ticked), with.ticks);
+    u64 stalled = 0;
+    for (int i = 0; i < timing::num_stall_causes; i++) {
+      e.add_to_state(offsetof(Translator::State, stalled_on) + i * sizeof(u64), with.stalls[i]);
+      stalled += with.stalls[i];
+    }
+    e.add_to_state(offsetof(Translator::State, stalled), stalled);
+    e.add_to_state(offsetof(Translator::State, retired), with.insns);
+  }
+
+  void emit_exit(u32 addr, const Cost& with, u64 flags) {
+    emit_cost(with);
+    e.bytes({ 0x48, 0xB8 }); // movabs rax, imm64
+    e.imm64(flags | addr);
+    const size_t rel = e.jmp_rel32();
+    e.patch_rel32(rel, exit_pos);
+  }
+
+  // Leave to another block, and jump there directly once it exists,
+  // unless out of ticks, which is the only way out of a loop of blocks
+  void emit_chained_exit(u32 addr, const Cost& with) {
+    emit_cost(with);
+    e.bytes({ 0x48, 0xB8 }); // movabs rax, imm64
+    e.imm64(addr);
+    e.bytes({ 0x49, 0x8B, 0x8E }); // mov rcx, [r14 + ticked]
+    e.imm32(offsetof(Translator::State, ticked));
+    e.bytes({ 0x49, 0x3B, 0x8E }); // cmp rcx, [r14 + tick_limit]
+    e.imm32(offsetof(Translator::State, tick_limit));
+    e.patch_rel32(e.jcc_rel32(Emitter::cc_above_equal), exit_pos);
+    const size_t rel = e.jmp_rel32();
+    e.patch_rel32(rel, exit_pos);
+    if (auto it = blocks.find(addr); it != blocks.end())
+      e.patch_rel32(rel, size_t(it->second - e.base));
+    else
+      unchained[addr].push_back(rel);
+  }
+
+  void emit_interpret_exit(u32 addr) {
+    emit_exit(addr, cost, exit_interpret | (after_memop ? exit_after_memop : 0));
+  }
+
+  size_t side_exit_here(u32 addr) {
+    side_exits.push_back({
+      .jumps = {},
+      .addr = addr,
+      .cost = cost,
+      .after_memop = after_memop,
+    });
+    return side_exits.size() - 1;
+  }
+
+  void emit_side_exits() {
+    for (auto& side: side_exits) {
+      for (size_t jump: side.jumps)
+        e.patch_rel32(jump, e.pos);
+      emit_exit(
+        side.addr, side.cost,
+        exit_interpret | (side.after_memop ? exit_after_memop : 0)
+      );
+    }
+  }
+
+  void settle_memop() {
+    if (after_memop)
+      cost.stall(timing::Stall::memop, 1);
+    after_memop = false;
+  }
+
+  void binop(u32 insn) {
+    const auto load_operand = [&] (int dest, u32 encoded) {
+      if (encoded & 1u)
+        e.load_isa_reg(dest, (encoded >> 1) & 0x3F);
+      else
+        e.load_imm(dest, encoded >> 1);
+    };
+    load_operand(Emitter::eax, (insn >> 10) & 0x7FF);
+    load_operand(Emitter::ecx, (insn >> 21) & 0x7FF);
+
+    const auto set_from_flags = [&] (int setcc) {
+      e.bytes({ 0x39, 0xC8 }); // cmp eax, ecx
+      e.bytes({ 0x0F, setcc, 0xC0 }); // setcc al
+      e.bytes({ 0x0F, 0xB6, 0xC0 }); // movzx eax, al
+    };
+
+    const auto op = Processor::Alu::op_of_binop(insn & 0xF);
+    switch (op) {
+      using enum Processor::Alu::Op;
+    case add: e.bytes({ 0x01, 0xC8 }); break; // add eax, ecx
+    case sub: e.bytes({ 0x29, 0xC8 }); break; // sub eax, ecx
+    case mul: e.bytes({ 0x0F, 0xAF, 0xC1 }); break; // imul eax, ecx
+    case div: e.bytes({ 0x31, 0xD2, 0xF7, 0xF1 }); break; // xor edx, edx; div ecx
+    case mod: e.bytes({ 0x31, 0xD2, 0xF7, 0xF1, 0x89, 0xD0 }); break; // ...; mov eax, edx
+    case equ: set_from_flags(0x94); break; // sete
+    case lt: set_from_flags(0x92); break; // setb
+    case gt: set_from_flags(0x97); break; // seta
+    }
+
+    e.store_isa_reg((insn >> 4) & 0x3F, Emitter::eax);
+    settle_memop();
+    cost.ticks++;
+    cost.insns++;
+    if (!proc.timing_config.muldiv_pipelined)
+      cost.stall(timing::Stall::muldiv, proc.alu_latency(op) - 1);
+  }
+
+  // Returns: whether the memop could be translated
+  bool memop(u32 addr_of_insn, u32 insn) {
+    const bool is_load = static_cast<Opcode>(insn & 0xF) == Opcode::load;
+    const u32 data_reg = (insn >> 4) & 0x3F;
+
+    if (insn & (1u << 10)) {
+      e.load_isa_reg(Emitter::eax, (insn >> 11) & 0x3F);
+    } else {
+      const u32 addr = insn >> 11;
+      if (addr < num_reserved_words)
+        return false;
+      e.load_imm(Emitter::eax, addr);
+    }
+
+    auto& side = side_exits[side_exit_here(addr_of_insn)];
+    e.bytes({ 0x3D }); // cmp eax, num_reserved_words
+    e.imm32(num_reserved_words);
+    side.jumps.push_back(e.jcc_rel32(Emitter::cc_below));
+
+    if (!is_load) {
+      e.bytes({ 0x89, 0xC2 }); // mov edx, eax
+      e.bytes({ 0x41, 0x2B, 0x96 }); // sub edx, [r14 + code_lo]
+      e.imm32(offsetof(Translator::State, code_lo));
+      e.bytes({ 0x41, 0x3B, 0x96 }); // cmp edx, [r14 + code_span]
+      e.imm32(offsetof(Translator::State, code_span));
+      side.jumps.push_back(e.jcc_rel32(Emitter::cc_below));
+    }
+
+    // Look the page up in the memory's page cache, which only ever has pages
+    // that exist. Anything else, the functional model has to deal with
+    static_assert(sizeof(Paged_memory::Cached_page) == 16);
+    static_assert(offsetof(Paged_memory::Cached_page, words) == 8);
+    e.bytes({ 0x89, 0xC2 }); // mov edx, eax
+    e.bytes({ 0xC1, 0xEA, Paged_memory::page_bits }); // shr edx, page_bits
+    e.bytes({ 0x41, 0x89, 0xD0 }); // mov r8d, edx
+    e.bytes({ 0x41, 0x83, 0xE0, Paged_memory::cache_size - 1 }); // and r8d, cache_size-1
+    e.bytes({ 0x41, 0xC1, 0xE0, 0x04 }); // shl r8d, 4
+    e.bytes({ 0x43, 0x3B, 0x14, 0x04 }); // cmp edx, [r12 + r8]
+    side.jumps.push_back(e.jcc_rel32(Emitter::cc_not_equal));
+    e.bytes({ 0x4B, 0x8B, 0x54, 0x04, 0x08 }); // mov rdx, [r12 + r8 + 8]
+    e.bytes({ 0x25 }); // and eax, page_words-1
+    e.imm32(Paged_memory::page_words - 1);
+
+    if (is_load) {
+      e.bytes({ 0x8B, 0x04, 0x82 }); // mov eax, [rdx + 4*rax]
+      e.store_isa_reg(data_reg, Emitter::eax);
+    } else {
+      e.load_isa_reg(Emitter::ecx, data_reg);
+      e.bytes({ 0x89, 0x0C, 0x82 }); // mov [rdx + 4*rax], ecx
+    }
+
+    if (after_memop) {
+      // Both bubbles, right away (see functional.cpp)
+      cost.ticks++;
+      cost.stall(timing::Stall::memop, 2 * (timing::memop_ticks - 1));
+      after_memop = false;
+    } else {
+      cost.ticks += timing::memop_ticks - 1;
+      after_memop = true;
+    }
+    cost.stall(timing::Stall::memory, proc.timing_config.memory_latency - 1);
+    cost.insns++;
+    return true;
+  }
+
+  // Returns: whether the block goes on after this insn
+  bool insn(u32 addr, u32 insn) {
+    switch (static_cast<Opcode>(insn & 0xF)) {
+    case Opcode::halt:
+      emit_interpret_exit(addr);
+      return false;
+
+    case Opcode::xadd: // Rare enough to leave to the functional model
+    case Opcode::vec: // ... and these already do a lot per insn
+      emit_interpret_exit(addr);
+      return false;
+
+    case Opcode::load:
+    case Opcode::store:
+      if (!memop(addr, insn)) {
+        emit_interpret_exit(addr);
+        return false;
+      }
+      return true;
+
+    case Opcode::jmp: {
+      cost.insns++;
+      Cost jumped = cost;
+      jumped.stall(timing::Stall::jump, timing::jmp_stall + proc.timing_config.jump_penalty);
+      emit_chained_exit(insn >> 4, jumped);
+      return false;
+    }
+
+    case Opcode::jif: {
+      e.bytes({ 0x83, 0xBB }); // cmp dword [rbx + 4*regid], 0
+      e.imm32(((insn >> 4) & 0x3F) * 4);
+      e.bytes({ 0x00 });
+      const size_t taken = e.jcc_rel32(Emitter::cc_not_equal);
+      cost.insns++;
+      Cost went_on = cost;
+      went_on.ticks++;
+      if (after_memop)
+        went_on.stall(timing::Stall::memop, 1);
+      emit_chained_exit(addr + 1, went_on);
+      e.patch_rel32(taken, e.pos);
+      Cost jumped = cost;
+      jumped.ticks++;
+      jumped.stall(timing::Stall::jump, timing::jif_taken_stall + proc.timing_config.jump_penalty);
+      emit_chained_exit(insn >> 10, jumped);
+      return false;
+    }
+
+    default:
+      binop(insn);
+      return true;
+    }
+  }
+};
+
+} // anon namespace
+
+auto Translator::translate(u32 start) -> Block {
+  make_writable(true); // Chaining patches older blocks as well
+  Emitter e { .base = buffer, .pos = buffer_used };
+  const Block block = buffer + e.pos;
+  blocks[start] = block;
+
+  Block_translation t {
+    .e = e,
+    .blocks = blocks,
+    .unchained = unchained,
+    .proc = proc,
+    .side_exits = {},
+  };
+
+  auto& memory = *proc.mem.memory;
+  u32 addr = start;
+  for (; ; addr++) {
+    if (!memory.find_page(addr >> Paged_memory::page_bits) || addr - start == max_block_insns) {
+      t.emit_interpret_exit(addr);
+      break;
+    }
+    if (!t.insn(addr, memory.load(addr)))
+      break;
+  }
+  t.emit_side_exits();
+  buffer_used = e.pos;
+
+  // Stores into the span of translated code are watched for
+  const u32 code_hi = state.code_span
+    ? std::max(state.code_lo + state.code_span, addr + 1)
+    : addr + 1;
+  state.code_lo = std::min(state.code_lo, start);
+  state.code_span = code_hi - state.code_lo;
+
+  // Whoever was waiting for this block can now jump to it directly
+  if (auto it = unchained.find(start); it != unchained.end()) {
+    for (size_t rel: it->second)
+      e.patch_rel32(rel, size_t(block - buffer));
+    unchained.erase(it);
+  }
+
+  return block;
+}
+
+#else // Not x86-64: no translation, just the functional model
+
+Translator::Translator(Processor& p): proc(p) {}
+Translator::~Translator() = default;
+
+bool Translator::run(u64 max_ticks) {
+  while (proc.stats.ticked < max_ticks)
+    if (!proc.next_insn())
+      return false;
+  return true;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+#include "processor.hpp"
+#include <cstddef>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+// ===========================================================================
+// Dynamic binary translation.
+//
+// Runs the program like `Processor::next_insn()` would, but translates basic
+// blocks (straight runs of code ending in a jmp, jif or halt) into host x86-64
+// code first, and chains translated blocks directly to one another.
+//
+// Anything the translated code cannot do on its own (MMIO, pages missing from
+// the memory's page cache, stores that might hit translated code, halting)
+// makes it exit back here, and that one instruction is done by the functional
+// model instead.
+// On hosts other than x86-64, everything is done by the functional model,
+// and so it is when the timing config has mul and div results waited for,
+// which translated code does not keep track of.
+
+struct Translator {
+  explicit Translator(Processor&);
+  ~Translator();
+  Translator(const Translator&) = delete;
+  Translator& operator=(const Translator&) = delete;
+
+  // Until the processor halts, or has ticked `max_ticks`, give or take a block.
+  // returns: whether it is still running
+  bool run(u64 max_ticks = std::numeric_limits<u64>::max());
+
+  // Laid out the way translated code expects it
+  struct State {
+    u32* registers;
+    Paged_memory::Cached_page* page_cache;
+    u64 ticked;
+    u64 stalled;
+    u64 stalled_on[timing::num_stall_causes];
+    u64 retired;
+    u64 tick_limit; // Of `ticked`, past which blocks exit instead of chaining
+    // Stores to [code_lo, code_lo + code_span) must not run translated
+    u32 code_lo;
+    u32 code_span;
+  };
+
+private:
+  Processor& proc;
+  State state = {};
+
+  std::byte* buffer = nullptr;
+  size_t buffer_used = 0;
+  bool writable = true; // Or executable, never both at once
+
+  using Block = const std::byte*;
+  std::unordered_map<u32, Block> blocks;
+  // Block exits which want to jump to an address that is not translated yet,
+  // by where their jump's rel32 lives in the buffer
+  std::unordered_map<u32, std::vector<size_t>> unchained;
+
+  Block lookup_or_translate(u32 addr);
+  Block translate(u32 addr);
+  void make_writable(bool);
+  void flush();
+  void sync_stats();
+  bool interpret_one();
+};
\ No newline at end of file
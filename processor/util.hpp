@@ -1,7 +1,10 @@
 #pragma once
+#include <charconv>
+#include <cstdint>
 #include <cstdlib>
 #include <fmt/core.h>
 #include <fmt/format.h>
+#include <string_view>
 #include <utility>
 
 namespace util {
@@ -23,4 +26,19 @@ void println(const fmt::format_string<Args...>& fmt, Args&&... args) {
     ::std::exit(1); \
   } while (false)
 
+// Of a command line option: decimal, or hex with a 0x prefix
+template<typename T = uint32_t>
+T parse_number(std::string_view text) {
+  int base = 10;
+  if (text.starts_with("0x") || text.starts_with("0X")) {
+    text.remove_prefix(2);
+    base = 16;
+  }
+  T result;
+  auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), result, base);
+  if (ec != std::errc{} || end != text.data() + text.size() || text.empty())
+    FATAL("Bad number '{}'", text);
+  return result;
+}
+
 } // namespace util
\ No newline at end of file
@@ -0,0 +1,25 @@
+#include "trace.hpp"
+#include <fmt/core.h>
+
+// Turn a binary trace written by `processor --trace-file=...`
+// into the same text the processor would have logged
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fmt::print(stderr, "Usage: {} <trace-file>\n", argv[0]);
+    return 1;
+  }
+
+  Trace_reader reader(argv[1]);
+  while (true) {
+    switch (reader.next()) {
+    case Trace_reader::Item::tick:
+      reader.record.print(stdout);
+      break;
+    case Trace_reader::Item::summary:
+      print_trace_summary(stdout, reader.summary.ticked, reader.summary.stalled);
+      break;
+    case Trace_reader::Item::end:
+      return 0;
+    }
+  }
+}